@@ -0,0 +1,45 @@
+#!/bin/sh
+# Throughput of a producer | filter | sink chain run by the shell, for a
+# range of inter-stage pipe buffer sizes.
+#
+# usage: bench/pipe_size.sh [bytes] [sizes...]
+#   bytes  amount pushed through the chain, head -c syntax (default 2G)
+#   sizes  pipesize arguments to try (default: kernel default, 64K .. 1M)
+
+shell=${SHELL_BIN:-./shell}
+bytes=${1:-2G}
+[ $# -gt 0 ] && shift
+sizes=${*:-default 64K 128K 256K 512K 1M}
+runs=${RUNS:-3}
+
+if [ ! -x "$shell" ]; then
+    echo "no shell binary at $shell, run make first" >&2
+    exit 1
+fi
+
+now_ns() {
+    date +%s%N
+}
+
+printf '%-10s %10s %12s\n' "pipesize" "best s" "MiB/s"
+for size in $sizes; do
+    best=
+    i=0
+    while [ $i -lt "$runs" ]; do
+        start=$(now_ns)
+        printf 'pipesize %s\nhead -c %s /dev/zero | tr a b | wc -c\n' \
+            "$size" "$bytes" | "$shell" --no-term-input > /dev/null
+        end=$(now_ns)
+        t=$((end - start))
+        if [ -z "$best" ] || [ $t -lt "$best" ]; then
+            best=$t
+        fi
+        i=$((i + 1))
+    done
+
+    total=$(numfmt --from=iec "$bytes")
+    awk -v size="$size" -v ns="$best" -v total="$total" 'BEGIN {
+        s = ns / 1e9
+        printf "%-10s %10.3f %12.1f\n", size, s, total / s / 1048576
+    }'
+done
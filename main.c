@@ -1,4 +1,6 @@
 /* JB-shell/main.c */
+#define _GNU_SOURCE
+
 #include "def.h"
 #include "buffer.h"
 #include "str.h"
@@ -7,30 +9,55 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <signal.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pwd.h>
 #include <dirent.h>
+#include <spawn.h>
+#include <fnmatch.h>
+#include <pthread.h>
 
+#include <errno.h>
 #include <limits.h>
 #include <stdalign.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
-enum {
-    c_program_mem_size = 1024 * 1024,
-
-    c_persistent_mem_size = c_program_mem_size / 4,
-    c_line_mem_size = c_program_mem_size / 2,
-    c_temp_mem_size = c_program_mem_size / 4,
+extern char **environ;
 
-    c_line_buf_size = 1024,
+enum {
+    // Address space reservations, pages are only committed when touched
+    c_persistent_mem_size = 256 * 1024 * 1024,
+    c_line_mem_size = 1024 * 1024 * 1024,
+    c_temp_mem_size = 256 * 1024 * 1024,
+
+    c_arena_commit_granularity = 64 * 1024,
+    c_arena_retained_commit = 1024 * 1024,
+
+    c_line_buf_initial_size = 1024,
+    c_read_block_size = 64 * 1024,
+    c_frame_buf_size = 64 * 1024,
+    c_exec_index_mem_size = 64 * 1024 * 1024,
+    c_term_path_mem_size = 16 * 1024 * 1024,
+    c_cmd_hash_mem_size = 16 * 1024 * 1024,
+    c_cmd_hash_initial_cap = 64,
+    c_env_mem_size = 64 * 1024 * 1024,
+    c_var_store_initial_cap = 64,
     c_history_entry_cnt = 64
 };
 
-STATIC_ASSERT(c_line_buf_size * c_history_entry_cnt < c_persistent_mem_size);
-
 #define MIN(a_, b_) ((a_) < (b_) ? (a_) : (b_))
 #define MAX(a_, b_) ((a_) > (b_) ? (a_) : (b_))
 #define ALIGN_UP(n_, align_) ((((n_) - 1) / (align_) + 1) * (align_))
@@ -57,9 +84,10 @@ static inline void mem_clear(void *mem, u64 sz)
         *p = 0;
 }
 
-static inline void mem_cpy(void *to, void *from, u64 sz)
+static inline void mem_cpy(void *to, void const *from, u64 sz)
 {
-    u8 *pt = (u8 *)to, *pf = (u8 *)from;
+    u8 *pt = (u8 *)to;
+    u8 const *pf = (u8 const *)from;
     for (u8 *end = pt + sz; pt != end; ++pt, ++pf)
         *pt = *pf;
 }
@@ -74,32 +102,151 @@ static inline void mem_cpy_bw(void *to, void *from, u64 sz)
     }
 }
 
+static inline u64 cstr_len(char const *cstr)
+{
+    u64 len = 0;
+    while (cstr[len])
+        ++len;
+    return len;
+}
+
 #define CLEAR(addr_) mem_clear((addr_), sizeof(*(addr_)))
 
+typedef struct arena_stats {
+    u64 high_water;
+    u64 alloc_cnt;
+    u64 padding_bytes;
+    u64 drop_cnt;
+    u64 dropped_bytes;
+} arena_stats_t;
+
+// buf spans the whole reserved range, only [0, committed) is accessible
 typedef struct arena {
     buffer_t buf;
+    u64 committed;
     u64 allocated;
+
+    char const *name;
+    arena_stats_t stats;
 } arena_t;
 
+enum {
+    c_max_registered_arenas = 16
+};
+
+// For stats reporting only
+static arena_t *g_registered_arenas[c_max_registered_arenas];
+static u32 g_registered_arena_cnt = 0;
+
+static b32 arena_init(arena_t *arena, char const *name, u64 reserve)
+{
+    ASSERT(c_arena_commit_granularity % sysconf(_SC_PAGESIZE) == 0);
+    arena->committed = 0;
+    arena->allocated = 0;
+    arena->name = name;
+    mem_clear(&arena->stats, sizeof(arena->stats));
+
+    if (g_registered_arena_cnt < c_max_registered_arenas)
+        g_registered_arenas[g_registered_arena_cnt++] = arena;
+
+    // MAP_NORESERVE + PROT_NONE: no swap accounting and nothing to copy on
+    // fork until the pages are actually committed
+    void *p = mmap(
+        NULL, reserve, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        clear_buffer(&arena->buf);
+        return false;
+    }
+
+    arena->buf.p = (char *)p;
+    arena->buf.sz = reserve;
+    return true;
+}
+
+static void arena_release(arena_t *arena)
+{
+    ASSERT(buffer_is_valid(&arena->buf));
+    for (u32 i = 0; i < g_registered_arena_cnt; ++i) {
+        if (g_registered_arenas[i] == arena) {
+            g_registered_arenas[i] =
+                g_registered_arenas[--g_registered_arena_cnt];
+            break;
+        }
+    }
+    munmap(arena->buf.p, arena->buf.sz);
+    clear_buffer(&arena->buf);
+    arena->committed = 0;
+    arena->allocated = 0;
+}
+
+static void arena_commit(arena_t *arena, u64 required)
+{
+    u64 const new_committed =
+        MIN(ALIGN_UP(required, c_arena_commit_granularity), arena->buf.sz);
+
+    if (UNLIKELY(required > arena->buf.sz ||
+        mprotect(
+            arena->buf.p + arena->committed, new_committed - arena->committed,
+            PROT_READ | PROT_WRITE) != 0))
+    {
+        fprintf(stderr,
+            "OOM: can't commit %lu bytes of a %lu byte arena\n",
+            required, arena->buf.sz);
+        exit(-1);
+    }
+
+    arena->committed = new_committed;
+}
+
 static u8 *arena_allocate_aligned(arena_t *arena, u64 bytes, u64 alignment)
 { 
-    // malloc alignment must be enough (since arena itself is mallocd)
+    // The reserved range is page-aligned, so this is always enough
     ASSERT(alignment <= 16 && 16 % alignment == 0);
     ASSERT(buffer_is_valid(&arena->buf));
     u64 const required_start = ALIGN_UP(arena->allocated, alignment);
 
-    if (UNLIKELY(required_start + bytes > arena->buf.sz)) {
-        fprintf(stderr, "OOM, check your assumptions!\n");
-        exit(-1);
-    }
+    if (UNLIKELY(required_start + bytes > arena->committed))
+        arena_commit(arena, required_start + bytes);
+
+    ++arena->stats.alloc_cnt;
+    arena->stats.padding_bytes += required_start - arena->allocated;
+
     u8 *ptr = (u8 *)arena->buf.p + required_start;
     arena->allocated = required_start + bytes;
+    arena->stats.high_water = MAX(arena->stats.high_water, arena->allocated);
     return ptr;
 }
 
 static inline void arena_drop(arena_t *arena)
 {
+    ++arena->stats.drop_cnt;
+    arena->stats.dropped_bytes += arena->allocated;
     arena->allocated = 0;
+
+    // Give back what an unusually large line has touched, keep the rest hot
+    if (UNLIKELY(arena->committed > c_arena_retained_commit)) {
+        char *tail = arena->buf.p + c_arena_retained_commit;
+        u64 const tail_sz = arena->committed - c_arena_retained_commit;
+        madvise(tail, tail_sz, MADV_DONTNEED);
+        mprotect(tail, tail_sz, PROT_NONE);
+        arena->committed = c_arena_retained_commit;
+    }
+}
+
+static void print_arena_stats(int fd)
+{
+    dprintf(fd, "%-12s %12s %12s %12s %10s %10s %8s %12s\n",
+        "arena", "in use", "committed", "high-water",
+        "allocs", "padding", "drops", "avg/drop");
+    for (u32 i = 0; i < g_registered_arena_cnt; ++i) {
+        arena_t const *a = g_registered_arenas[i];
+        dprintf(fd, "%-12s %12lu %12lu %12lu %10lu %10lu %8lu %12lu\n",
+            a->name, a->allocated, a->committed, a->stats.high_water,
+            a->stats.alloc_cnt, a->stats.padding_bytes, a->stats.drop_cnt,
+            a->stats.drop_cnt ?
+                a->stats.dropped_bytes / a->stats.drop_cnt : 0);
+    }
 }
 
 #define ARENA_ALLOC(arena_, type_) \
@@ -110,7 +257,6 @@ static inline void arena_drop(arena_t *arena)
 
 enum {
     c_rl_ok = 0,
-    c_rl_string_overflow = -1,
     c_rl_eof = -2,
 };
 
@@ -131,6 +277,28 @@ static inline b32 is_separator_char(int c)
         (c == ';') | (c == ')') | (c == '(');
 }
 
+static inline b32 is_var_name_start(int c)
+{
+    return (c >= 'a' && c <= 'z') | (c >= 'A' && c <= 'Z') | (c == '_');
+}
+
+static inline b32 is_var_name_char(int c)
+{
+    return is_var_name_start(c) | (c >= '0' && c <= '9');
+}
+
+// NAME=..., name_len gets the length of the name
+static b32 is_assignment(string_t word, u64 *name_len)
+{
+    if (word.len == 0 || !is_var_name_start(word.p[0]))
+        return false;
+    u64 i = 1;
+    while (i < word.len && is_var_name_char(word.p[i]))
+        ++i;
+    *name_len = i;
+    return i < word.len && word.p[i] == '=';
+}
+
 static inline b32 is_ws_or_sep(int c)
 {
     return is_whitespace(c) || is_separator_char(c);
@@ -177,34 +345,112 @@ static b32 path_has_dir(split_path_t const *path)
     return !string_is_empty(&path->dir);
 }
 
+// Nodes (and names) don't have to be contiguous, so other allocations
+// (like the dedup set) can be made in the same arena while a list is filled
+typedef struct fslist_node {
+    string_t name;
+    struct fslist_node *next;
+} fslist_node_t;
+
 typedef struct fslist {
-    string_t *entries;
+    fslist_node_t *first;
+    fslist_node_t *last;
     u32 cnt;
 } fslist_t;
 
 static b32 iterate_fslist(
     fslist_t const *list, b32 (*cb)(string_t, void *), void *user)
 {
-    u32 cnt = list->cnt;
-    string_t const *s = list->entries;
-    while (cnt--) {
-        if (!cb(*s, user))
+    for (fslist_node_t const *node = list->first; node; node = node->next) {
+        if (!cb(node->name, user))
             return false;
-        s = (string_t *)((u8 *)s +
-            ALIGN_UP(sizeof(string_t) + s->len + 1, _Alignof(string_t)));
     }
     return true;
 }
 
-static b32 fslist_elem_is_not_eq(string_t elem, void *user)
+static string_t fslist_push(fslist_t *list, string_t str, arena_t *arena)
+{
+    fslist_node_t *node = ARENA_ALLOC(arena, fslist_node_t);
+    node->name.p = ARENA_ALLOC_N(arena, char, str.len + 1);
+    node->name.len = str.len;
+    mem_cpy(node->name.p, str.p, str.len);
+    node->name.p[str.len] = '\0';
+    node->next = NULL;
+
+    if (list->last)
+        list->last->next = node;
+    else
+        list->first = node;
+    list->last = node;
+    ++list->cnt;
+    return node->name;
+}
+
+enum {
+    c_str_set_initial_cap = 64
+};
+
+// Open addressing (linear probing) set for deduplicating candidates,
+// the strings themselves are not copied
+typedef struct str_set {
+    string_t *slots; // p == NULL means empty
+    u32 cap;         // power of 2
+    u32 cnt;
+    arena_t *arena;
+} str_set_t;
+
+static void str_set_init(str_set_t *set, u32 cap, arena_t *arena)
+{
+    ASSERT(cap > 0 && (cap & (cap - 1)) == 0);
+    set->slots = ARENA_ALLOC_N(arena, string_t, cap);
+    mem_clear(set->slots, cap * sizeof(*set->slots));
+    set->cap = cap;
+    set->cnt = 0;
+    set->arena = arena;
+}
+
+static string_t *str_set_find_slot(
+    string_t *slots, u32 cap, string_t str, u64 hash)
 {
-    string_t *needle = (string_t *)user;
-    return !str_eq(elem, *needle);
+    u32 const mask = cap - 1;
+    for (u32 i = (u32)hash & mask;; i = (i + 1) & mask) {
+        if (!string_is_valid(&slots[i]) || str_eq(slots[i], str))
+            return &slots[i];
+    }
+}
+
+static b32 str_set_contains(str_set_t const *set, string_t str)
+{
+    return string_is_valid(
+        str_set_find_slot(set->slots, set->cap, str, str_hash(str)));
+}
+
+static void str_set_insert(str_set_t *set, string_t str)
+{
+    if ((set->cnt + 1) * 2 > set->cap) {
+        str_set_t grown;
+        str_set_init(&grown, set->cap * 2, set->arena);
+        for (u32 i = 0; i < set->cap; ++i) {
+            string_t const s = set->slots[i];
+            if (string_is_valid(&s))
+                *str_set_find_slot(grown.slots, grown.cap, s, str_hash(s)) = s;
+        }
+        grown.cnt = set->cnt;
+        *set = grown;
+    }
+
+    string_t *slot =
+        str_set_find_slot(set->slots, set->cap, str, str_hash(str));
+    if (!string_is_valid(slot)) {
+        *slot = str;
+        ++set->cnt;
+    }
 }
 
 typedef struct search_autocomplete_in_dir_args {
     string_t prefix;
     fslist_t *out;
+    str_set_t *seen;
     arena_t *arena;
 } search_autocomplete_in_dir_args_t; 
 static b32 search_autocomplete_in_dir(string_t dir, void *user)
@@ -223,31 +469,205 @@ static b32 search_autocomplete_in_dir(string_t dir, void *user)
         string_t dname = str_from_cstr(dent->d_name);
         if (str_is_prefix_of(args->prefix, dname)) {
             // If already contained, don't add
-            if (!iterate_fslist(args->out, fslist_elem_is_not_eq, &dname))
+            if (str_set_contains(args->seen, dname))
                 continue;
 
-            string_t *s = ARENA_ALLOC(args->arena, string_t); 
-            s->p = ARENA_ALLOC_N(args->arena, char, dname.len + 1);
-            s->len = dname.len;
-            mem_cpy(s->p, dname.p, s->len);
-            s->p[s->len] = '\0';
-            ++args->out->cnt;
-            if (!args->out->entries)
-                args->out->entries = s;
+            str_set_insert(
+                args->seen, fslist_push(args->out, dname, args->arena));
         }
     }
+    closedir(desc);
+    return true;
+}
+
+typedef struct exec_index_entry {
+    string_t name;
+    u32 dir_id;
+} exec_index_entry_t;
+
+typedef struct exec_index_dir {
+    string_t path;
+    struct timespec mtime;
+    b32 exists;
+} exec_index_dir_t;
+
+// Sorted list of everything in PATH for first word completion. Rebuilt only
+// when a directory mtime changes, and then only changed dirs are rescanned.
+// The live generation is in arenas[cur], the next one is built in the other.
+typedef struct exec_index {
+    arena_t arenas[2];
+    u32 cur;
+
+    exec_index_dir_t *dirs;
+    u32 dir_cnt;
+
+    exec_index_entry_t *entries;
+    u32 entry_cnt;
+    b32 built;
+} exec_index_t;
+
+static b32 init_exec_index(
+    exec_index_t *index, fslist_t const *path, arena_t *arena)
+{
+    if (!arena_init(&index->arenas[0], "exec-index", c_exec_index_mem_size))
+        return false;
+    if (!arena_init(&index->arenas[1], "exec-index", c_exec_index_mem_size)) {
+        arena_release(&index->arenas[0]);
+        return false;
+    }
+
+    index->cur = 0;
+    index->dirs = ARENA_ALLOC_N(arena, exec_index_dir_t, path->cnt);
+    index->dir_cnt = 0;
+    index->entries = NULL;
+    index->entry_cnt = 0;
+    index->built = false;
+
+    for (fslist_node_t const *node = path->first; node; node = node->next) {
+        exec_index_dir_t *dir = &index->dirs[index->dir_cnt++];
+        CLEAR(dir);
+        dir->path = node->name;
+    }
+
     return true;
 }
 
+static void release_exec_index(exec_index_t *index)
+{
+    arena_release(&index->arenas[0]);
+    arena_release(&index->arenas[1]);
+}
+
+static int exec_index_entry_cmp(void const *e1, void const *e2)
+{
+    exec_index_entry_t const *a = (exec_index_entry_t const *)e1;
+    exec_index_entry_t const *b = (exec_index_entry_t const *)e2;
+    int const cmp = str_cmp(a->name, b->name);
+    return cmp != 0 ? cmp : (int)a->dir_id - (int)b->dir_id;
+}
+
+static void exec_index_push(
+    exec_index_entry_t **out_entries, u32 *out_cnt,
+    string_t name, u32 dir_id, arena_t *names_arena, arena_t *list_arena)
+{
+    exec_index_entry_t *e = ARENA_ALLOC(list_arena, exec_index_entry_t);
+    if (*out_cnt == 0)
+        *out_entries = e;
+    ++*out_cnt;
+
+    e->name.p = ARENA_ALLOC_N(names_arena, char, name.len + 1);
+    e->name.len = name.len;
+    mem_cpy(e->name.p, name.p, name.len);
+    e->name.p[name.len] = '\0';
+    e->dir_id = dir_id;
+}
+
+static void exec_index_revalidate(exec_index_t *index, arena_t *tmp)
+{
+    b32 *changed = ARENA_ALLOC_N(tmp, b32, index->dir_cnt);
+    b32 any_changed = !index->built;
+
+    for (u32 i = 0; i < index->dir_cnt; ++i) {
+        exec_index_dir_t *dir = &index->dirs[i];
+        struct stat st;
+        b32 const exists = stat(dir->path.p, &st) == 0;
+        changed[i] = !index->built || exists != dir->exists ||
+            (exists &&
+            (st.st_mtim.tv_sec != dir->mtime.tv_sec ||
+            st.st_mtim.tv_nsec != dir->mtime.tv_nsec));
+        dir->exists = exists;
+        if (exists)
+            dir->mtime = st.st_mtim;
+        any_changed |= changed[i];
+    }
+
+    if (!any_changed)
+        return;
+
+    arena_t *next = &index->arenas[index->cur ^ 1];
+    arena_drop(next);
+
+    // The unsorted list lives in tmp (names don't interleave with it)
+    u64 const tmp_mark = tmp->allocated;
+    exec_index_entry_t *list = NULL;
+    u32 cnt = 0;
+
+    for (u32 i = 0; i < index->entry_cnt; ++i) {
+        exec_index_entry_t const *e = &index->entries[i];
+        if (!changed[e->dir_id])
+            exec_index_push(&list, &cnt, e->name, e->dir_id, next, tmp);
+    }
+
+    string_t const dot = LITSTR(".");
+    string_t const dotdot = LITSTR("..");
+    for (u32 i = 0; i < index->dir_cnt; ++i) {
+        if (!changed[i] || !index->dirs[i].exists)
+            continue;
+        DIR *desc = opendir(index->dirs[i].path.p);
+        if (!desc)
+            continue;
+        struct dirent *dent;
+        while ((dent = readdir(desc)) != NULL) {
+            string_t dname = str_from_cstr(dent->d_name);
+            if (!str_eq(dname, dot) && !str_eq(dname, dotdot))
+                exec_index_push(&list, &cnt, dname, i, next, tmp);
+        }
+        closedir(desc);
+    }
+
+    if (cnt > 0)
+        qsort(list, cnt, sizeof(*list), exec_index_entry_cmp);
+
+    index->entries = ARENA_ALLOC_N(next, exec_index_entry_t, cnt);
+    mem_cpy(index->entries, list, cnt * sizeof(*list));
+    index->entry_cnt = cnt;
+    index->built = true;
+
+    arena_drop(&index->arenas[index->cur]);
+    index->cur ^= 1;
+    tmp->allocated = tmp_mark;
+}
+
+static void exec_index_lookup(
+    exec_index_t const *index, string_t prefix, fslist_t *out, arena_t *arena)
+{
+    u32 lo = 0, hi = index->entry_cnt;
+    while (lo < hi) {
+        u32 const mid = lo + (hi - lo) / 2;
+        if (str_cmp(index->entries[mid].name, prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // Same names from different dirs are adjacent
+    string_t prev = {0};
+    for (u32 i = lo; i < index->entry_cnt; ++i) {
+        string_t const name = index->entries[i].name;
+        if (!str_is_prefix_of(prefix, name))
+            break;
+        if (string_is_valid(&prev) && str_eq(prev, name))
+            continue;
+        fslist_push(out, name, arena);
+        prev = name;
+    }
+}
+
 static fslist_t search_autocomplete(
-    string_t prefix, fslist_t const *path, arena_t *arena)
+    string_t prefix, fslist_t const *path, exec_index_t *index, arena_t *arena)
 {
     fslist_t res = {0};
+    str_set_t seen;
+    str_set_init(&seen, c_str_set_initial_cap, arena);
     split_path_t pref_path = split_path(prefix);
-    search_autocomplete_in_dir_args_t args = {pref_path.file, &res, arena};
+    search_autocomplete_in_dir_args_t args =
+        {pref_path.file, &res, &seen, arena};
     if (path_has_dir(&pref_path))
         search_autocomplete_in_dir(pref_path.dir, &args);
-    else if (path)
+    else if (path && index) {
+        exec_index_revalidate(index, arena);
+        exec_index_lookup(index, pref_path.file, &res, arena);
+    } else if (path)
         iterate_fslist(path, search_autocomplete_in_dir, &args);
     else {
         string_t cwd = LITSTR(".");
@@ -256,8 +676,111 @@ static fslist_t search_autocomplete(
     return res;
 }
 
+enum {
+    c_ev_input = 1,
+    c_ev_child = 2,
+    c_ev_interrupt = 4,
+};
+
+// Signals are not delivered to handlers, they are read from a signalfd
+// next to the input whenever the shell has to block
+typedef struct event_loop {
+    int epfd;
+    int sigfd;
+    int input_fd; // -1 if never watched
+    b32 input_armed;
+} event_loop_t;
+
+static event_loop_t g_loop = {-1, -1, -1, false};
+
+static void release_event_loop(event_loop_t *loop)
+{
+    if (loop->sigfd >= 0)
+        close(loop->sigfd);
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    loop->epfd = loop->sigfd = loop->input_fd = -1;
+    loop->input_armed = false;
+}
+
+// SIGINT is only taken over for an interactive session, input_fd may be -1
+static b32 init_event_loop(event_loop_t *loop, int input_fd, b32 catch_int)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    if (catch_int)
+        sigaddset(&set, SIGINT);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+
+    loop->sigfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->input_fd = -1;
+    loop->input_armed = false;
+    if (loop->sigfd < 0 || loop->epfd < 0) {
+        release_event_loop(loop);
+        return false;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = loop->sigfd;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->sigfd, &ev);
+
+    // Registered disarmed, otherwise pending input would spin job waits
+    if (input_fd >= 0) {
+        ev.events = 0;
+        ev.data.fd = input_fd;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, input_fd, &ev) == 0)
+            loop->input_fd = input_fd;
+    }
+    return true;
+}
+
+// Exec'd programs must not inherit the blocked signals
+static void unblock_signals(void)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+}
+
+// Returns a c_ev_* mask, 0 on timeout
+static u32 event_loop_wait(event_loop_t *loop, b32 want_input, int timeout_ms)
+{
+    want_input = want_input && loop->input_fd >= 0;
+    if (want_input != loop->input_armed) {
+        struct epoll_event ev = {0};
+        ev.events = want_input ? EPOLLIN : 0;
+        ev.data.fd = loop->input_fd;
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, loop->input_fd, &ev);
+        loop->input_armed = want_input;
+    }
+
+    struct epoll_event evs[2];
+    int const cnt = epoll_wait(loop->epfd, evs, 2, timeout_ms);
+
+    u32 res = 0;
+    for (int i = 0; i < cnt; ++i) {
+        if (evs[i].data.fd == loop->input_fd) {
+            res |= c_ev_input;
+            continue;
+        }
+
+        struct signalfd_siginfo si;
+        while (read(loop->sigfd, &si, sizeof(si)) == sizeof(si)) {
+            if (si.ssi_signo == SIGCHLD)
+                res |= c_ev_child;
+            else if (si.ssi_signo == SIGINT)
+                res |= c_ev_interrupt;
+        }
+    }
+    return res;
+}
+
+// Entries are mallocd to exact length, so lines of any size fit
 typedef struct history_entry {
-    char buf[c_line_buf_size];
+    buffer_t line;
 } history_entry_t;
 
 typedef struct terminal_session {
@@ -267,7 +790,17 @@ typedef struct terminal_session {
     char input_buf[64];
     u32 buffered_chars_cnt;
 
+    // Editor output is accumulated here and written once per frame
+    char *frame;
+    u32 frame_len;
+
+    // Rebuilt when PATH changes, from its own arena
+    arena_t path_arena;
+    b32 has_path_arena;
+    u64 path_gen; // of the PATH var loaded, 0 for none
     fslist_t path;
+    exec_index_t exec_index;
+    b32 has_exec_index;
 
     history_entry_t *history;
     u32 history_head;
@@ -278,27 +811,46 @@ typedef struct terminal_session {
     arena_t *persmem;
 } terminal_session_t;
 
-static void init_term(terminal_session_t *term)
+// Replaces the PATH dirs used for first word completion
+static void term_load_path(
+    terminal_session_t *term, string_t path_var, u64 path_gen)
 {
-    tcgetattr(STDIN_FILENO, &term->backup_ts);
-    char *path = getenv("PATH");
-    if (path) {
-        while (*path) {
-            string_t *s = ARENA_ALLOC(term->persmem, string_t);
-            if ((term->path.cnt++) == 0)
-                term->path.entries = s;
-            s->p = ARENA_ALLOC_N(term->persmem, char, 0);
-            while (*path && *path != ':') {
-                s->p[s->len++] = *path++;
-                (void)ARENA_ALLOC(term->persmem, char);
-            }
-            s->p[s->len] = '\0';
-            (void)ARENA_ALLOC(term->persmem, char);
-            if (*path)
-                ++path;
+    if (!term->has_path_arena)
+        return;
+
+    if (term->has_exec_index)
+        release_exec_index(&term->exec_index);
+    arena_drop(&term->path_arena);
+    CLEAR(&term->path);
+    term->path_gen = path_gen;
+
+    for (u64 i = 0; i < path_var.len;) {
+        string_t dir = {path_var.p + i, 0};
+        while (i < path_var.len && path_var.p[i] != ':') {
+            ++i;
+            ++dir.len;
         }
+        fslist_push(&term->path, dir, &term->path_arena);
+        ++i;
     }
 
+    term->has_exec_index = init_exec_index(
+        &term->exec_index, &term->path, &term->path_arena);
+}
+
+static void init_term(terminal_session_t *term)
+{
+    tcgetattr(STDIN_FILENO, &term->backup_ts);
+
+    // PATH is loaded from the variable store before each line
+    term->has_path_arena =
+        arena_init(&term->path_arena, "term-path", c_term_path_mem_size);
+    term->path_gen = 0;
+    term->has_exec_index = false;
+
+    term->frame = ARENA_ALLOC_N(term->persmem, char, c_frame_buf_size);
+    term->frame_len = 0;
+
     term->history =
         ARENA_ALLOC_N(term->persmem, history_entry_t, c_history_entry_cnt);
     mem_clear(term->history, c_history_entry_cnt * sizeof(*term->history));
@@ -308,6 +860,12 @@ static void init_term(terminal_session_t *term)
     term->history_current = 0;
 }
 
+static void free_history_entry(history_entry_t *entry)
+{
+    if (buffer_is_valid(&entry->line))
+        free_buffer(&entry->line);
+}
+
 static void shutdown_term(terminal_session_t *term, b32 drain)
 {
     if (drain) {
@@ -319,17 +877,27 @@ static void shutdown_term(terminal_session_t *term, b32 drain)
     }
 
     tcsetattr(STDIN_FILENO, TCSANOW, &term->backup_ts);
+
+    for (int i = 0; i < c_history_entry_cnt; ++i)
+        free_history_entry(&term->history[i]);
+
+    if (term->has_exec_index)
+        release_exec_index(&term->exec_index);
+    if (term->has_path_arena)
+        arena_release(&term->path_arena);
 }
 
 static void history_push(terminal_session_t *term, string_t line)
 {
-    ASSERT(line.len < c_line_buf_size);
+    history_entry_t *entry =
+        &term->history[term->history_head % c_history_entry_cnt];
+    free_history_entry(entry);
+    entry->line = allocate_buffer(line.len);
+    if (!buffer_is_valid(&entry->line))
+        return;
 
-    mem_cpy(
-        term->history[term->history_head % c_history_entry_cnt].buf,
-        line.p, line.len);
-    term->history[term->history_head % c_history_entry_cnt]
-        .buf[line.len] = '\0';
+    mem_cpy(entry->line.p, line.p, line.len);
+    entry->line.p[line.len] = '\0';
 
     ++term->history_head;
     term->history_current = term->history_head;
@@ -337,9 +905,14 @@ static void history_push(terminal_session_t *term, string_t line)
     if (term->history_filled_entries < c_history_entry_cnt - 1)
         ++term->history_filled_entries;
 
-    mem_clear(
-        &term->history[term->history_head % c_history_entry_cnt],
-        sizeof(*term->history));
+    free_history_entry(
+        &term->history[term->history_head % c_history_entry_cnt]);
+}
+
+static string_t history_entry_str(history_entry_t const *entry)
+{
+    string_t res = {entry->line.p, entry->line.sz};
+    return res;
 }
 
 static void start_terminal_editing(terminal_session_t *term)
@@ -363,32 +936,74 @@ static void finish_terminal_editing(terminal_session_t *term)
     arena_drop(term->tmpmem);
 }
 
-static void move_cursor_to_pos(int from, int to, terminal_session_t const *term)
+static void frame_flush(terminal_session_t *term)
+{
+    char const *p = term->frame;
+    u32 left = term->frame_len;
+    while (left > 0) {
+        ssize_t const written = write(STDOUT_FILENO, p, left);
+        if (written < 0 && errno == EINTR)
+            continue;
+        else if (written <= 0)
+            break;
+        p += written;
+        left -= written;
+    }
+    term->frame_len = 0;
+}
+
+static void frame_append(terminal_session_t *term, char const *p, u64 len)
+{
+    while (len > 0) {
+        if (term->frame_len == c_frame_buf_size)
+            frame_flush(term);
+        u64 const chunk = MIN(len, c_frame_buf_size - term->frame_len);
+        mem_cpy(term->frame + term->frame_len, (void *)p, chunk);
+        term->frame_len += chunk;
+        p += chunk;
+        len -= chunk;
+    }
+}
+
+static inline void frame_putc(terminal_session_t *term, char c)
+{
+    frame_append(term, &c, 1);
+}
+
+static void frame_printf(terminal_session_t *term, char const *fmt, ...)
+{
+    char tmp[64];
+    va_list args;
+    va_start(args, fmt);
+    int const len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+    va_end(args);
+    ASSERT(len >= 0 && len < (int)sizeof(tmp));
+    frame_append(term, tmp, len);
+}
+
+static void move_cursor_to_pos(int from, int to, terminal_session_t *term)
 {
     int from_lines = from / term->wsz.ws_col;
     int from_chars = from % term->wsz.ws_col;
     int to_lines = to / term->wsz.ws_col;
     int to_chars = to % term->wsz.ws_col;
 
-    if (from_lines < to_lines) {
-        for (int i = 0; i < to_lines - from_lines; ++i)
-            printf("\033[B");
-    } else if (from_lines > to_lines) {
-        for (int i = 0; i < from_lines - to_lines; ++i)
-            printf("\033[A");
-    }
-    if (from_chars < to_chars) {
-        for (int i = 0; i < to_chars - from_chars; ++i)
-            printf("\033[C");
-    } else if (from_chars > to_chars) {
-        for (int i = 0; i < from_chars - to_chars; ++i)
-            printf("\033[D");
-    }
+    if (from_lines < to_lines)
+        frame_printf(term, "\033[%dB", to_lines - from_lines);
+    else if (from_lines > to_lines)
+        frame_printf(term, "\033[%dA", from_lines - to_lines);
+
+    if (to_chars == 0 && from_chars != 0)
+        frame_putc(term, '\r');
+    else if (from_chars < to_chars)
+        frame_printf(term, "\033[%dC", to_chars - from_chars);
+    else if (from_chars > to_chars)
+        frame_printf(term, "\033[%dD", from_chars - to_chars);
 }
 
 typedef struct print_autocomplete_opt_args {
     int *pos;
-    terminal_session_t const *term;
+    terminal_session_t *term;
     int max_rows;
     int col_alignment;
 } print_autocomplete_opt_args_t;
@@ -410,8 +1025,8 @@ static b32 print_autocomplete_opt(string_t opt, void *user)
 
     if (aligned_chars + MAX((int)opt.len, args->col_alignment) > w) {
         for (int i = start_chars; i < w; ++i)
-            putchar(' ');
-        putchar('\n');
+            frame_putc(args->term, ' ');
+        frame_putc(args->term, '\n');
         *args->pos += w - start_chars;
 
         start_chars = 0;
@@ -419,38 +1034,246 @@ static b32 print_autocomplete_opt(string_t opt, void *user)
         ++start_row;
     }
     for (int i = start_chars; i < aligned_chars; ++i)
-        putchar(' ');
+        frame_putc(args->term, ' ');
     *args->pos += aligned_chars - start_chars;
 
     if (start_row < max_rows) {
         *args->pos += opt.len;
         while ((int)opt.len >= w) {
-            string_t subs = {opt.p, w};
-            printf("%.*s\n", STR_PRINTF_ARGS(subs));
+            frame_append(args->term, opt.p, w);
+            frame_putc(args->term, '\n');
             opt.p += w;
             opt.len -= (u64)w;
         }
-        printf("%.*s", STR_PRINTF_ARGS(opt));
-    } else
-        *args->pos += printf("...");
+        frame_append(args->term, opt.p, opt.len);
+    } else {
+        frame_append(args->term, "...", 3);
+        *args->pos += 3;
+    }
     return true;
 }
 
+// Text is [0, gap_start) + [gap_end, cap), the cursor is always at the gap,
+// so typing and deleting at the cursor don't move the rest of the line.
+// The storage is the topmost allocation of the arena and grows in place.
+typedef struct gap_buffer {
+    char *p;
+    u64 cap;
+    u64 gap_start;
+    u64 gap_end;
+    arena_t *arena;
+} gap_buffer_t;
+
+static void gb_init(gap_buffer_t *gb, arena_t *arena, u64 cap)
+{
+    gb->p = ARENA_ALLOC_N(arena, char, cap);
+    gb->cap = cap;
+    gb->gap_start = 0;
+    gb->gap_end = cap;
+    gb->arena = arena;
+}
+
+static inline u64 gb_len(gap_buffer_t const *gb)
+{
+    return gb->cap - (gb->gap_end - gb->gap_start);
+}
+
+static inline u64 gb_cursor(gap_buffer_t const *gb)
+{
+    return gb->gap_start;
+}
+
+static inline char gb_char_at(gap_buffer_t const *gb, u64 i)
+{
+    return i < gb->gap_start ?
+        gb->p[i] : gb->p[i + (gb->gap_end - gb->gap_start)];
+}
+
+// Chars before the cursor are always contiguous
+static inline string_t gb_before_cursor(gap_buffer_t const *gb)
+{
+    string_t res = {gb->p, gb->gap_start};
+    return res;
+}
+
+static void gb_reserve(gap_buffer_t *gb, u64 bytes)
+{
+    if (gb->gap_end - gb->gap_start >= bytes)
+        return;
+
+    u64 const new_cap = MAX(gb->cap * 2, gb_len(gb) + bytes);
+    u64 const tail_len = gb->cap - gb->gap_end;
+    char *ext = ARENA_ALLOC_N(gb->arena, char, new_cap - gb->cap);
+    if (ext != gb->p + gb->cap) {
+        // Somebody allocated after us, relocate
+        char *new_p = ARENA_ALLOC_N(gb->arena, char, new_cap);
+        mem_cpy(new_p, gb->p, gb->gap_start);
+        mem_cpy(new_p + new_cap - tail_len, gb->p + gb->gap_end, tail_len);
+        gb->p = new_p;
+    } else if (tail_len > 0)
+        mem_cpy_bw(gb->p + new_cap - tail_len, gb->p + gb->gap_end, tail_len);
+
+    gb->gap_end = new_cap - tail_len;
+    gb->cap = new_cap;
+}
+
+static void gb_insert(gap_buffer_t *gb, string_t str)
+{
+    gb_reserve(gb, str.len);
+    mem_cpy(gb->p + gb->gap_start, str.p, str.len);
+    gb->gap_start += str.len;
+}
+
+static void gb_delete_back(gap_buffer_t *gb, u64 cnt)
+{
+    ASSERT(cnt <= gb->gap_start);
+    gb->gap_start -= cnt;
+}
+
+static void gb_move_cursor(gap_buffer_t *gb, u64 pos)
+{
+    ASSERT(pos <= gb_len(gb));
+    if (pos < gb->gap_start) {
+        u64 const cnt = gb->gap_start - pos;
+        mem_cpy_bw(gb->p + gb->gap_end - cnt, gb->p + pos, cnt);
+        gb->gap_start -= cnt;
+        gb->gap_end -= cnt;
+    } else if (pos > gb->gap_start) {
+        u64 const cnt = pos - gb->gap_start;
+        mem_cpy(gb->p + gb->gap_start, gb->p + gb->gap_end, cnt);
+        gb->gap_start += cnt;
+        gb->gap_end += cnt;
+    }
+}
+
+static void gb_set(gap_buffer_t *gb, string_t str)
+{
+    gb->gap_start = 0;
+    gb->gap_end = gb->cap;
+    gb_insert(gb, str);
+}
+
+// Closes the gap, the result is '\0'-terminated
+static string_t gb_to_string(gap_buffer_t *gb)
+{
+    gb_move_cursor(gb, gb_len(gb));
+    gb_reserve(gb, 1);
+    gb->p[gb->gap_start] = '\0';
+    string_t res = {gb->p, gb->gap_start};
+    return res;
+}
+
+enum {
+    c_prompt_len = 2
+};
+
+typedef struct line_render_state {
+    int cursor;     // screen position, prompt included
+    int extent;     // chars drawn after the prompt, completions included
+    u64 dirty_from; // first char of the line changed since the last frame
+} line_render_state_t;
+
+// Only the changed span is redrawn, everything goes out in one write
+static void render_line_frame(
+    terminal_session_t *term, gap_buffer_t const *gb, line_render_state_t *rs,
+    fslist_t const *autocompletes, b32 clrscr, b32 done)
+{
+    int const w = term->wsz.ws_col;
+    int const len = gb_len(gb);
+
+    if (clrscr) {
+        for (int i = 0; i < term->wsz.ws_row; ++i)
+            frame_putc(term, '\n');
+        frame_append(term, "> ", c_prompt_len);
+        rs->cursor = c_prompt_len;
+        rs->extent = 0;
+        rs->dirty_from = 0;
+    }
+
+    if ((int)rs->dirty_from < len) {
+        move_cursor_to_pos(rs->cursor, rs->dirty_from + c_prompt_len, term);
+        for (int i = rs->dirty_from; i < len; ++i) {
+            frame_putc(term, gb_char_at(gb, i));
+            if ((i + c_prompt_len + 1) % w == 0)
+                frame_putc(term, '\n');
+        }
+        rs->cursor = len + c_prompt_len;
+    }
+
+    b32 const show_autocompletes = autocompletes->cnt > 0 && !done;
+    if (rs->extent > len || show_autocompletes) {
+        move_cursor_to_pos(rs->cursor, len + c_prompt_len, term);
+        frame_append(term, "\033[J", 3);
+        rs->cursor = len + c_prompt_len;
+    }
+    rs->extent = len;
+
+    if (show_autocompletes) {
+        int curspos = rs->cursor;
+        if (curspos % w != 0) {
+            frame_putc(term, '\n');
+            curspos = ALIGN_UP(curspos, w);
+        }
+
+        print_autocomplete_opt_args_t args =
+            {&curspos, term, 8, MAX(w / 6, 16)};
+        iterate_fslist(autocompletes, print_autocomplete_opt, &args);
+        rs->cursor = curspos;
+        rs->extent = curspos - c_prompt_len;
+    }
+
+    if (done) {
+        move_cursor_to_pos(rs->cursor, len + c_prompt_len, term);
+        if ((len + c_prompt_len) % w != 0)
+            frame_putc(term, '\n');
+    } else {
+        int const epos = gb_cursor(gb) + c_prompt_len;
+        move_cursor_to_pos(rs->cursor, epos, term);
+        rs->cursor = epos;
+    }
+
+    rs->dirty_from = len;
+    frame_flush(term);
+}
+
+static b32 reap_finished_jobs(void);
+static void notify_finished_jobs(void);
+
+// Prints the job reports under the line being edited and draws it again
+static void report_jobs_while_editing(
+    terminal_session_t *term, gap_buffer_t const *gb, line_render_state_t *rs)
+{
+    int const end = rs->extent + c_prompt_len;
+    move_cursor_to_pos(rs->cursor, end, term);
+    if (end % term->wsz.ws_col != 0)
+        frame_putc(term, '\n');
+    frame_flush(term);
+
+    notify_finished_jobs();
+
+    fslist_t const no_autocompletes = {0};
+    frame_append(term, "> ", c_prompt_len);
+    rs->cursor = c_prompt_len;
+    rs->extent = 0;
+    rs->dirty_from = 0;
+    render_line_frame(term, gb, rs, &no_autocompletes, false, false);
+}
+
 static int read_line_from_terminal(
-    buffer_t *buf, string_t *out_string, terminal_session_t *term)
+    arena_t *arena, string_t *out_string, terminal_session_t *term)
 {
     start_terminal_editing(term);
 
-    printf("> ");
     fflush(stdout);
+    frame_append(term, "> ", c_prompt_len);
+    frame_flush(term);
 
     int res = c_rl_ok;
 
-    ASSERT(buffer_is_valid(buf));
-    ASSERT(buf->sz > 0);
+    gap_buffer_t gb;
+    gb_init(&gb, arena, c_line_buf_initial_size);
 
-    string_t s = {buf->p, 0};
-    int epos = 0;
+    line_render_state_t rs = {c_prompt_len, 0, 0};
 
     enum {
         e_st_dfl,
@@ -459,23 +1282,29 @@ static int read_line_from_terminal(
     } state = e_st_dfl;
 
     b32 done = false;
-    int prev_len = 0;
 
     while (!done) {
         char *p;
         int chars_consumed;
-        int prev_epos = epos;
         b32 clrscr = false;
 
         fslist_t autocompletes = {0};
 
         if (!term->buffered_chars_cnt) {
-            term->buffered_chars_cnt =
+            u32 ev;
+            do {
+                ev = event_loop_wait(&g_loop, true, -1);
+                if ((ev & c_ev_child) && reap_finished_jobs())
+                    report_jobs_while_editing(term, &gb, &rs);
+            } while (!(ev & c_ev_input));
+
+            ssize_t const chars_read =
                 read(STDIN_FILENO, term->input_buf, sizeof(term->input_buf));
-            if (!term->buffered_chars_cnt) {
+            if (chars_read <= 0) {
                 res = c_rl_eof;
                 break;
             }
+            term->buffered_chars_cnt = chars_read;
         }
 
         for (p = term->input_buf;
@@ -491,14 +1320,8 @@ static int read_line_from_terminal(
                         --term->history_current;
                         int const id =
                             term->history_current % c_history_entry_cnt; 
-                        epos = s.len = 0;
-                        for (char const *from = term->history[id].buf;
-                            *from; ++from)
-                        {
-                            s.p[epos++] = *from;
-                            ++s.len;
-                        }
-                        ASSERT(s.len < buf->sz);
+                        gb_set(&gb, history_entry_str(&term->history[id]));
+                        rs.dirty_from = 0;
                     }
                     continue;
                 case 66:
@@ -507,24 +1330,18 @@ static int read_line_from_terminal(
                         ++term->history_current;
                         int const id =
                             term->history_current % c_history_entry_cnt; 
-                        epos = s.len = 0;
-                        for (char const *from = term->history[id].buf;
-                            *from; ++from)
-                        {
-                            s.p[epos++] = *from;
-                            ++s.len;
-                        }
-                        ASSERT(s.len < buf->sz);
+                        gb_set(&gb, history_entry_str(&term->history[id]));
+                        rs.dirty_from = 0;
                     }
                     continue;
                 case 67:
-                    if (epos < (int)s.len)
-                        ++epos;
+                    if (gb_cursor(&gb) < gb_len(&gb))
+                        gb_move_cursor(&gb, gb_cursor(&gb) + 1);
                     state = e_st_dfl;
                     continue;
                 case 68:
-                    if (epos > 0)
-                        --epos;
+                    if (gb_cursor(&gb) > 0)
+                        gb_move_cursor(&gb, gb_cursor(&gb) - 1);
                     state = e_st_dfl;
                     continue;
                 default:
@@ -559,54 +1376,47 @@ static int read_line_from_terminal(
             case '\b':
             case 23:
             case 21: {
-                int chars_to_delete;
-                if (epos == 0)
+                string_t const curs = gb_before_cursor(&gb);
+                u64 chars_to_delete;
+                if (curs.len == 0)
                     break;
                 if (*p == 23) {
                     b32 skipping_ws = true;
                     chars_to_delete = 0;
-                    while (chars_to_delete < epos &&
-                        (!is_ws_or_sep(s.p[epos - chars_to_delete - 1]) ||
-                        skipping_ws))
+                    char const *prev = curs.p + curs.len - 1;
+                    while (chars_to_delete < curs.len &&
+                        (!is_ws_or_sep(*prev) || skipping_ws))
                     {
-                        if (!is_ws_or_sep(s.p[epos - chars_to_delete - 1]))
+                        if (!is_ws_or_sep(*prev))
                             skipping_ws = false;
                         ++chars_to_delete;
+                        --prev;
                     }
                 } else if (*p == 21) {
-                    chars_to_delete = epos;
+                    chars_to_delete = curs.len;
                 } else {
                     chars_to_delete = 1;
                 }
-                if (epos < (int)s.len) {
-                    mem_cpy(
-                        s.p + epos - chars_to_delete,
-                        s.p + epos,
-                        s.len - epos);
-                }
-                epos -= chars_to_delete;
-                s.len -= chars_to_delete;
+                gb_delete_back(&gb, chars_to_delete);
+                rs.dirty_from = MIN(rs.dirty_from, gb_cursor(&gb));
             } break;
             case '\t': {
-                string_t curs = {s.p, epos};
+                string_t curs = gb_before_cursor(&gb);
                 b32 is_first = false;
                 string_t tok = get_token_postfix(curs, &is_first);
                 autocompletes = search_autocomplete(
-                    tok, is_first ? &term->path : NULL, term->tmpmem);
-                if (autocompletes.cnt == 1 &&
-                    autocompletes.entries[0].len + epos < buf->sz)
-                {
-                    split_path_t path = split_path(autocompletes.entries[0]);
+                    tok, is_first ? &term->path : NULL,
+                    term->has_exec_index ? &term->exec_index : NULL,
+                    term->tmpmem);
+                if (autocompletes.cnt == 1) {
+                    split_path_t path = split_path(autocompletes.first->name);
                     split_path_t split_tok = split_path(tok);
                     string_t inserted = {
                         path.file.p + split_tok.file.len,
                         path.file.len - split_tok.file.len
                     };
-                    mem_cpy_bw(
-                        s.p + epos + inserted.len, s.p + epos, inserted.len);
-                    mem_cpy(s.p + epos, inserted.p, inserted.len);
-                    epos += inserted.len;
-                    s.len += inserted.len;
+                    rs.dirty_from = MIN(rs.dirty_from, gb_cursor(&gb));
+                    gb_insert(&gb, inserted);
                     CLEAR(&autocompletes);
                 }
             } break;
@@ -614,12 +1424,9 @@ static int read_line_from_terminal(
             default:
                 if (*p < 32) // no control characters
                     break;
-                if (s.len < buf->sz - 1) {
-                    if (epos < (int)s.len)
-                        mem_cpy_bw(s.p + epos + 1, s.p + epos, s.len - epos);
-                    s.p[epos++] = *p;
-                    ++s.len;
-                }
+                string_t const typed = {p, 1};
+                rs.dirty_from = MIN(rs.dirty_from, gb_cursor(&gb));
+                gb_insert(&gb, typed);
             }
 
             state = e_st_dfl;
@@ -631,75 +1438,155 @@ static int read_line_from_terminal(
         if (chars_consumed < (int)term->buffered_chars_cnt)
             mem_cpy(term->input_buf, p, term->buffered_chars_cnt);
 
-        if (clrscr) {
-            for (int i = 0; i < term->wsz.ws_row; ++i)
-                putchar('\n');
-            prev_epos = -2;
-        }
-
-        move_cursor_to_pos(prev_epos + 2, 0, term);
-        int chars_printed = printf("> ");
-        for (int i = 0; i < MAX((int)s.len, prev_len); ++i) {
-            putchar(i < (int)s.len ? s.p[i] : ' ');
-            if ((++chars_printed) % term->wsz.ws_col == 0)
-                putchar('\n');
-        }
-
-        int curspos = MAX((int)s.len, prev_len) + 2;
-        if (autocompletes.cnt > 0 && !done) {
-            move_cursor_to_pos(curspos, s.len + 2, term);
-            curspos = s.len + 2;
-            int linebreak = ALIGN_UP(curspos, term->wsz.ws_col);
-            for (; curspos < linebreak; ++curspos)
-                putchar(' ');
-            putchar('\n');
-            curspos = linebreak;
-
-            print_autocomplete_opt_args_t args =
-                {&curspos, term, 8, MAX(term->wsz.ws_col / 6, 16)};
-            iterate_fslist(&autocompletes, print_autocomplete_opt, &args);
-            prev_len = curspos - 2;
-        } else
-            prev_len = s.len;
-
-        if (epos + 2 < curspos)
-            move_cursor_to_pos(curspos, epos + 2, term);
-        if (done)
-            putchar('\n');
-
-        fflush(stdout);
+        render_line_frame(term, &gb, &rs, &autocompletes, clrscr, done);
 
         arena_drop(term->tmpmem);
     }
 
 func_end:
     finish_terminal_editing(term);
-    s.p[s.len] = '\0';
-    *out_string = s;
+    *out_string = gb_to_string(&gb);
     return res;
 }
 
-static int read_line_from_regular_stdin(buffer_t *buf, string_t *out_string)
+typedef struct block_reader {
+    int fd;
+    char *block;
+    u64 head; // unconsumed data is [head, tail)
+    u64 tail;
+    b32 eof;
+
+    u64 mapped_sz; // if not 0, block is a mapping of the whole file
+    b32 owns_fd;
+} block_reader_t;
+
+static void init_block_reader(block_reader_t *rd, int fd, arena_t *arena)
+{
+    rd->fd = fd;
+    rd->block = ARENA_ALLOC_N(arena, char, c_read_block_size);
+    rd->head = rd->tail = 0;
+    rd->eof = false;
+    rd->mapped_sz = 0;
+    rd->owns_fd = false;
+}
+
+// A regular file becomes one block, so lines are never copied. Anything
+// else, like a pipe or /dev/stdin, has no size and is read in blocks.
+static b32 init_mapped_block_reader(
+    block_reader_t *rd, char const *path, arena_t *arena)
 {
-    ASSERT(buffer_is_valid(buf));
-    ASSERT(buf->sz > 0);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        init_block_reader(rd, fd, arena);
+        rd->owns_fd = true;
+        return true;
+    }
 
-    string_t s = {buf->p, 0};
+    rd->fd = -1;
+    rd->owns_fd = false;
+    rd->head = 0;
+    rd->tail = (u64)st.st_size;
+    rd->eof = true;
+    rd->mapped_sz = (u64)st.st_size;
+
+    if (rd->mapped_sz == 0) {
+        static char empty_block[1];
+        rd->block = empty_block;
+        close(fd);
+        return true;
+    }
 
-    int c;
-    while (!is_eol(c = getchar())) {
-        s.p[s.len++] = (char)c;
-        if (s.len >= buf->sz)
-            return c_rl_string_overflow;
+    void *p = mmap(NULL, rd->mapped_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+
+    madvise(p, rd->mapped_sz, MADV_SEQUENTIAL);
+    rd->block = (char *)p;
+    return true;
+}
+
+static void release_block_reader(block_reader_t *rd)
+{
+    if (rd->mapped_sz > 0)
+        munmap(rd->block, rd->mapped_sz);
+    if (rd->owns_fd)
+        close(rd->fd);
+    rd->owns_fd = false;
+    rd->block = NULL;
+    rd->mapped_sz = 0;
+}
+
+static b32 block_reader_refill(block_reader_t *rd)
+{
+    rd->head = rd->tail = 0;
+    while (!rd->eof) {
+        ssize_t const bytes = read(rd->fd, rd->block, c_read_block_size);
+        if (bytes > 0) {
+            rd->tail = (u64)bytes;
+            return true;
+        } else if (bytes < 0 && errno == EINTR)
+            continue;
+        rd->eof = true;
     }
+    return false;
+}
+
+// The returned line is a view into the block (valid until the next call) and
+// is only copied to the arena if it spans several blocks. No '\0' at the end.
+static int read_line_from_block_reader(
+    block_reader_t *rd, arena_t *arena, string_t *out_string)
+{
+    string_t spill = {0};
+
+    for (;;) {
+        char *start = rd->block + rd->head;
+        u64 const avail = rd->tail - rd->head;
+        char *eol = (char *)memchr(start, '\n', avail);
+        u64 const chunk_len = eol ? (u64)(eol - start) : avail;
+
+        if ((eol || (rd->eof && avail > 0)) && !string_is_valid(&spill)) {
+            rd->head += eol ? chunk_len + 1 : chunk_len;
+            out_string->p = start;
+            out_string->len = chunk_len;
+            break;
+        }
+
+        // An exactly consumed block leaves nothing to spill, so the next
+        // line is still a view if it fits into the refilled block
+        if (chunk_len > 0) {
+            // Consecutive char allocations are contiguous
+            char *dst = ARENA_ALLOC_N(arena, char, chunk_len);
+            if (!string_is_valid(&spill))
+                spill.p = dst;
+            ASSERT(dst == spill.p + spill.len);
+            mem_cpy(dst, start, chunk_len);
+            spill.len += chunk_len;
+        }
+
+        if (eol) {
+            rd->head += chunk_len + 1;
+            *out_string = spill;
+            break;
+        }
 
-    if (c == EOF) {
-        s.len = 0;
-        return c_rl_eof;
+        if (!block_reader_refill(rd)) {
+            // Last line may come without a trailing newline
+            if (spill.len == 0)
+                return c_rl_eof;
+            *out_string = spill;
+            break;
+        }
     }
 
-    s.p[s.len] = '\0';
-    *out_string = s;
     return c_rl_ok;
 }
 
@@ -709,6 +1596,8 @@ typedef enum token_type {
     e_tt_eol,        // last token
     e_tt_ident,      // anything
     e_tt_in,         // <
+    e_tt_heredoc,    // <<
+    e_tt_herestring, // <<<
     e_tt_out,        // >
     e_tt_append,     // >>
     e_tt_pipe,       // |
@@ -726,12 +1615,28 @@ typedef enum token_type {
 
 typedef struct token {
     token_type_t type;
-    string_t id;
+    string_t id; // not NUL-terminated, see compile_plan
+    b32 expand; // id is the source text, expanded when the command runs
+    b32 quoted; // had a " or a \ in it
 } token_t;
 
+// Fed to stdin through a pipe or a memfd, nothing goes to the filesystem
+typedef struct stdin_doc {
+    string_t text;  // heredoc body, or the word of a here-string
+    string_t delim; // a heredoc body is read from the lines after
+    b32 expand;
+    b32 is_word;    // <<< word, a newline follows it
+
+    struct stdin_doc *next_pending;
+} stdin_doc_t;
+
 typedef struct lexer {
     string_t line;
     u64 pos;
+
+    // Heredocs on the line, in order
+    stdin_doc_t *pending_docs;
+    stdin_doc_t *last_pending_doc;
 } lexer_t;
 
 static inline int lexer_peek(lexer_t *lexer)
@@ -746,6 +1651,92 @@ static inline void lexer_consume(lexer_t *lexer)
     ++lexer->pos;
 }
 
+// Index just past the $(...) or `...` that opens at pos, 0 if it is not
+// closed on this line
+static u64 skip_cmd_subst(string_t s, u64 pos)
+{
+    if (s.p[pos] == '`') {
+        for (u64 i = pos + 1; i < s.len && s.p[i] != '\n'; ++i) {
+            if (s.p[i] == '\\')
+                ++i;
+            else if (s.p[i] == '`')
+                return i + 1;
+        }
+        return 0;
+    }
+
+    ASSERT(s.p[pos] == '$' && s.p[pos + 1] == '(');
+    u32 depth = 0;
+    b32 in_quotes = false;
+    for (u64 i = pos + 1; i < s.len && s.p[i] != '\n'; ++i) {
+        char const c = s.p[i];
+        if (c == '\\')
+            ++i;
+        else if (c == '"')
+            in_quotes = !in_quotes;
+        else if (in_quotes)
+            continue;
+        else if (c == '(')
+            ++depth;
+        else if (c == ')' && --depth == 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+static inline b32 is_cmd_subst_start(string_t s, u64 pos)
+{
+    return s.p[pos] == '`' ||
+        (s.p[pos] == '$' && pos + 1 < s.len && s.p[pos + 1] == '(');
+}
+
+// $NAME or ${NAME}
+static inline b32 is_var_ref_start(string_t s, u64 pos)
+{
+    return s.p[pos] == '$' && pos + 1 < s.len &&
+        (is_var_name_start(s.p[pos + 1]) || s.p[pos + 1] == '{');
+}
+
+static inline b32 is_glob_char(char c)
+{
+    return (c == '*') | (c == '?') | (c == '[');
+}
+
+// *, ? or a [ with a ] after it in the same word
+static b32 is_glob_start(string_t s, u64 pos)
+{
+    if (s.p[pos] != '[')
+        return is_glob_char(s.p[pos]);
+    for (u64 i = pos + 1; i < s.len; ++i) {
+        if (s.p[i] == ']')
+            return true;
+        else if (is_whitespace(s.p[i]) || is_separator_char(s.p[i]))
+            break;
+    }
+    return false;
+}
+
+// Same for a built word, where \ screens the next char
+static b32 has_glob(string_t s)
+{
+    for (u64 i = 0; i < s.len; ++i) {
+        if (s.p[i] == '\\')
+            ++i;
+        else if (s.p[i] == '*' || s.p[i] == '?')
+            return true;
+        else if (s.p[i] == '[' && memchr(s.p + i, ']', s.len - i))
+            return true;
+    }
+    return false;
+}
+
+// Nothing in a word the lexer has to look at
+static inline b32 is_plain_word_char(char c)
+{
+    return !is_eol(c) && !is_whitespace(c) && !is_separator_char(c) &&
+        c != '\\' && c != '"' && c != '$' && c != '`' && !is_glob_char(c);
+}
+
 static token_t get_next_token(lexer_t *lexer, arena_t *arena)
 {
     token_t tok = {0};
@@ -757,6 +1748,7 @@ static token_t get_next_token(lexer_t *lexer, arena_t *arena)
 
     b32 in_quotes = false;
     b32 screen_next = false;
+    u64 start = 0;
     int c;
 
     while (!is_eol(c = lexer_peek(lexer))) {
@@ -794,7 +1786,16 @@ static token_t get_next_token(lexer_t *lexer, arena_t *arena)
 
             case '<':
                 lexer_consume(lexer);
-                tok.type = e_tt_in;
+                if (lexer_peek(lexer) != '<')
+                    tok.type = e_tt_in;
+                else {
+                    lexer_consume(lexer);
+                    if (lexer_peek(lexer) == '<') {
+                        lexer_consume(lexer);
+                        tok.type = e_tt_herestring;
+                    } else
+                        tok.type = e_tt_heredoc;
+                }
                 return tok;
             case ';':
                 lexer_consume(lexer);
@@ -811,6 +1812,7 @@ static token_t get_next_token(lexer_t *lexer, arena_t *arena)
 
             default:
                 state = e_lst_parsing_identifier;
+                start = lexer->pos;
             }
         }
 
@@ -821,24 +1823,73 @@ static token_t get_next_token(lexer_t *lexer, arena_t *arena)
                 break;
             }
 
-            lexer_consume(lexer);
-
+            // A slice of the line up to the first \ or "
             if (!string_is_valid(&tok.id))
-                tok.id.p = ARENA_ALLOC_N(arena, char, 0);
+                tok.id.p = lexer->line.p + lexer->pos;
+
+            // Runs of plain chars are taken whole
+            if (!in_quotes && !screen_next) {
+                u64 end = lexer->pos;
+                while (end < lexer->line.len &&
+                       is_plain_word_char(lexer->line.p[end]))
+                {
+                    ++end;
+                }
+                if (end > lexer->pos) {
+                    u64 const run = end - lexer->pos;
+                    if (tok.quoted) {
+                        char *dst = ARENA_ALLOC_N(arena, char, run);
+                        ASSERT(dst == tok.id.p + tok.id.len);
+                        mem_cpy(dst, lexer->line.p + lexer->pos, run);
+                    }
+                    tok.id.len += run;
+                    lexer->pos = end;
+                    continue;
+                }
+            }
 
-            if (c == '\\' && !screen_next) {
-                screen_next = true;
+            // Skipped whole, the word is kept as source text
+            if (!screen_next && is_cmd_subst_start(lexer->line, lexer->pos)) {
+                u64 const end = skip_cmd_subst(lexer->line, lexer->pos);
+                if (!end) {
+                    tok.type = e_tt_lexer_error;
+                    return tok;
+                }
+                lexer->pos = end;
+                tok.expand = true;
                 continue;
             }
+            if (!screen_next && is_var_ref_start(lexer->line, lexer->pos))
+                tok.expand = true;
+            if (!screen_next && !in_quotes &&
+                is_glob_start(lexer->line, lexer->pos))
+            {
+                tok.expand = true;
+            }
+
+            lexer_consume(lexer);
 
-            if (c == '"' && !screen_next) {
-                in_quotes = !in_quotes;
+            if ((c == '\\' || c == '"') && !screen_next) {
+                // From here on the word differs from the source
+                if (!tok.quoted) {
+                    char *copy = ARENA_ALLOC_N(arena, char, tok.id.len);
+                    mem_cpy(copy, tok.id.p, tok.id.len);
+                    tok.id.p = copy;
+                    tok.quoted = true;
+                }
+                if (c == '\\')
+                    screen_next = true;
+                else
+                    in_quotes = !in_quotes;
                 continue;
             }
 
             ASSERT(c >= SCHAR_MIN && c <= SCHAR_MAX);
-            (void)ARENA_ALLOC(arena, char);
-            tok.id.p[tok.id.len++] = (char)c;
+            if (tok.quoted) {
+                (void)ARENA_ALLOC(arena, char);
+                tok.id.p[tok.id.len] = (char)c;
+            }
+            ++tok.id.len;
 
             screen_next = false;
         }
@@ -852,9 +1903,10 @@ static token_t get_next_token(lexer_t *lexer, arena_t *arena)
     if (state == e_lst_prefix_separator)
         tok.type = e_tt_eol;
     else {
-        // To make linux syscalls happy
-        (void)ARENA_ALLOC(arena, char);
-        tok.id.p[tok.id.len] = '\0';
+        if (tok.expand) {
+            tok.id.p = lexer->line.p + start;
+            tok.id.len = lexer->pos - start;
+        }
 
         tok.type = e_tt_ident;
     }
@@ -882,6 +1934,7 @@ static inline b32 tok_is_cmd_elem_or_lparen(token_t tok)
 {
     return
         (tok.type == e_tt_ident) | (tok.type == e_tt_in) |
+        (tok.type == e_tt_heredoc) | (tok.type == e_tt_herestring) |
         (tok.type == e_tt_out) | (tok.type == e_tt_append) |
         (tok.type == e_tt_lparen);
 }
@@ -895,13 +1948,24 @@ struct uncond_chain_node;
 
 typedef struct arg_node {
     string_t name;
+    b32 expand; // see token_t
     struct arg_node *next;
 } arg_node_t;
 
+struct builtin_desc;
+
 typedef struct command_node {
-    string_t cmd;
+    string_t cmd; // invalid if there are only assignments
+    b32 cmd_expand;
     arg_node_t *args;    
     u64 arg_cnt;
+
+    // NAME=value words in front, for the environment of the command
+    arg_node_t *assigns;
+    u64 assign_cnt;
+
+    struct builtin_desc const *builtin;
+    char **argv; // prebuilt for a kept plan, see plan_cache_t
 } command_node_t;
 
 typedef enum runnable_type {
@@ -929,8 +1993,12 @@ typedef struct pipe_chain_node {
     string_t stdin_redir;
     string_t stdout_redir;
     string_t stdout_append_redir;
+    stdin_doc_t *stdin_doc;
+    b32 stdin_expand;
+    b32 stdout_expand;
 
-    b32 is_cd;
+    b32 has_expansions; // in any word of the elements or the redirections
+    u64 pipe_size; // 0 for the global setting
 } pipe_chain_node_t;
 
 typedef enum cond_link {
@@ -948,6 +2016,7 @@ typedef struct cond_node {
 typedef struct cond_chain_node {
     cond_node_t *chain;
     u64 cond_cnt;
+    b32 timed; // time keyword in front
 } cond_chain_node_t;
 
 typedef enum uncond_link {
@@ -983,7 +2052,14 @@ static void print_uncond_chain(uncond_chain_node_t const *, int);
 static void print_command(command_node_t const *cmd, int indentation)
 {
     print_indentation(indentation);
-    printf("cmd:<%.*s>", STR_PRINTF_ARGS(cmd->cmd));
+    if (cmd->assign_cnt) {
+        printf("assigns:[<%.*s>", STR_PRINTF_ARGS(cmd->assigns->name));
+        for (arg_node_t *a = cmd->assigns->next; a; a = a->next)
+            printf(", <%.*s>", STR_PRINTF_ARGS(a->name));
+        printf("]%s", string_is_valid(&cmd->cmd) ? ", " : "");
+    }
+    if (string_is_valid(&cmd->cmd))
+        printf("cmd:<%.*s>", STR_PRINTF_ARGS(cmd->cmd));
     if (cmd->arg_cnt) {
         printf(", args:[<%.*s>", STR_PRINTF_ARGS(cmd->args->name));
         for (arg_node_t *arg = cmd->args->next; arg; arg = arg->next)
@@ -1028,6 +2104,11 @@ static void print_pipe_chain(pipe_chain_node_t const *chain,
     if (string_is_valid(&chain->stdin_redir)) {
         print_indentation(indentation);
         printf("stdin -> %.*s\n", STR_PRINTF_ARGS(chain->stdin_redir));
+    } else if (chain->stdin_doc) {
+        print_indentation(indentation);
+        printf("stdin <- %s (%lu bytes)\n",
+            chain->stdin_doc->is_word ? "here-string" : "heredoc",
+            chain->stdin_doc->text.len);
     }
     if (string_is_valid(&chain->stdout_redir)) {
         print_indentation(indentation);
@@ -1045,6 +2126,10 @@ static void print_cond_chain(cond_chain_node_t const *chain, int indentation)
         print_indentation(indentation);
         printf("<NULL>\n");
     }
+    if (chain->timed) {
+        print_indentation(indentation);
+        printf("time\n");
+    }
     int const children_indentation =
         chain->cond_cnt > 1 ? indentation + 1 : indentation;
     for (cond_node_t *cond = chain->chain; cond; cond = cond->next) {
@@ -1074,76 +2159,32 @@ static void print_uncond_chain(uncond_chain_node_t const *chain,
     }
 }
 
-static b32 command_is_cd(command_node_t const *cmd)
-{
-    string_t const cdstr = LITSTR("cd");
-    return str_eq(cmd->cmd, cdstr);
-}
-
-enum {
-    c_not_cd = 0,
-    c_is_cd = 1,
-    c_invalid_cd = 2,
-};
-
-// cd can not be part of a pipe, must have 0 or 1 args & cant have io redir
-static int check_if_pipe_is_cd(pipe_chain_node_t const *pp)
-{
-    if (CHAIN_IS_EMPTY(pp))
-        return c_not_cd;
-
-    if (pp->cmd_cnt > 1) {
-        for (pipe_node_t const *elem = pp->chain->next;
-            elem; elem = elem->next)
-        {
-            if (elem->runnable.type == e_rnt_cmd &&
-                command_is_cd(elem->runnable.cmd))
-            {
-                return c_invalid_cd;
-            }
-        }
-    }
-
-    runnable_node_t const *first = &pp->chain->runnable;
-
-    if (first->type != e_rnt_cmd || !command_is_cd(first->cmd))
-        return c_not_cd;
-
-    if (first->cmd->arg_cnt > 1)
-        return c_invalid_cd;
-
-    if (string_is_valid(&pp->stdin_redir) ||
-        string_is_valid(&pp->stdout_redir) ||
-        string_is_valid(&pp->stdout_append_redir))
-    {
-        return c_invalid_cd;
-    }
-
-    return c_is_cd;
-}
+static struct builtin_desc const *find_builtin(command_node_t const *cmd);
 
 static token_t parse_uncond_chain(lexer_t *, uncond_chain_node_t *, arena_t *);
 
 static token_t parse_runnable(
     lexer_t *lexer,
     runnable_node_t *out_runnable,
-    string_t *out_stdin_redir,
-    string_t *out_stdout_redir,
-    string_t *out_stdout_append_redir,
+    pipe_chain_node_t *out_pp, // gets the redirections
     arena_t *arena)
 {
     token_t tok = {0};
 
     CLEAR(out_runnable);    
     arg_node_t *last_arg = NULL;
+    arg_node_t *last_assign = NULL;
+    b32 words_expand = false;
 
     while (tok_is_cmd_elem_or_lparen(tok = get_next_token(lexer, arena))) {
-        if (tok.type == e_tt_in) {
+        if (tok.type == e_tt_in || tok.type == e_tt_heredoc ||
+            tok.type == e_tt_herestring)
+        {
             if (RUNNABLE_IS_EMPTY(out_runnable)) {
                 tok.type = e_tt_parser_error; // @TODO: elaborate
                 break; 
             }
-            if (string_is_valid(out_stdin_redir)) {
+            if (string_is_valid(&out_pp->stdin_redir) || out_pp->stdin_doc) {
                 tok.type = e_tt_parser_error; // @TODO: elaborate
                 break; 
             }
@@ -1155,14 +2196,44 @@ static token_t parse_runnable(
                 tok.type = e_tt_parser_error;
                 break;
             } 
-            *out_stdin_redir = next.id;
+
+            if (tok.type == e_tt_in) {
+                out_pp->stdin_redir = next.id;
+                out_pp->stdin_expand = next.expand;
+                out_pp->has_expansions |= next.expand;
+                continue;
+            }
+
+            stdin_doc_t *doc = ARENA_ALLOC(arena, stdin_doc_t);
+            CLEAR(doc);
+            if (tok.type == e_tt_herestring) {
+                doc->text = next.id;
+                doc->expand = next.expand;
+                doc->is_word = true;
+            } else {
+                // The delimiter is taken literally, quoting it keeps the
+                // body from being expanded
+                if (next.expand) {
+                    tok.type = e_tt_parser_error; // @TODO: elaborate
+                    break;
+                }
+                doc->delim = next.id;
+                doc->expand = !next.quoted;
+                if (lexer->last_pending_doc)
+                    lexer->last_pending_doc->next_pending = doc;
+                else
+                    lexer->pending_docs = doc;
+                lexer->last_pending_doc = doc;
+            }
+            out_pp->stdin_doc = doc;
+            out_pp->has_expansions |= doc->expand;
         } else if (tok.type == e_tt_out || tok.type == e_tt_append) {
             if (RUNNABLE_IS_EMPTY(out_runnable)) {
                 tok.type = e_tt_parser_error; // @TODO: elaborate
                 break; 
             }
-            if (string_is_valid(out_stdout_redir) ||
-                string_is_valid(out_stdout_append_redir))
+            if (string_is_valid(&out_pp->stdout_redir) ||
+                string_is_valid(&out_pp->stdout_append_redir))
             { // @TODO: elaborate
                 tok.type = e_tt_parser_error;
                 break; 
@@ -1177,9 +2248,11 @@ static token_t parse_runnable(
             } 
 
             if (tok.type == e_tt_out)
-                *out_stdout_redir = next.id;
+                out_pp->stdout_redir = next.id;
             else
-                *out_stdout_append_redir = next.id;
+                out_pp->stdout_append_redir = next.id;
+            out_pp->stdout_expand = next.expand;
+            out_pp->has_expansions |= next.expand;
         } else if (tok.type == e_tt_ident) {
             if (!RUNNABLE_IS_EMPTY(out_runnable) &&
                 out_runnable->type == e_rnt_subshell)
@@ -1187,22 +2260,44 @@ static token_t parse_runnable(
                 tok.type = e_tt_parser_error; // @TODO: elaborate
                 break; 
             }
+            words_expand |= tok.expand;
+            out_pp->has_expansions |= tok.expand;
 
             if (RUNNABLE_IS_EMPTY(out_runnable)) {
                 out_runnable->cmd = ARENA_ALLOC(arena, command_node_t);
                 CLEAR(out_runnable->cmd);
-                out_runnable->cmd->cmd = tok.id;
                 out_runnable->type = e_rnt_cmd;
+            }
+
+            command_node_t *cmd = out_runnable->cmd;
+            u64 name_len;
+            if (!string_is_valid(&cmd->cmd) &&
+                is_assignment(tok.id, &name_len))
+            {
+                arg_node_t *assign = ARENA_ALLOC(arena, arg_node_t);
+                assign->name = tok.id;
+                assign->expand = tok.expand;
+                assign->next = NULL;
+                if (cmd->assign_cnt == 0)
+                    cmd->assigns = assign;
+                else
+                    last_assign->next = assign;
+                last_assign = assign;
+                ++cmd->assign_cnt;
+            } else if (!string_is_valid(&cmd->cmd)) {
+                cmd->cmd = tok.id;
+                cmd->cmd_expand = tok.expand;
             } else {
                 arg_node_t *arg = ARENA_ALLOC(arena, arg_node_t);
                 arg->name = tok.id;
+                arg->expand = tok.expand;
                 arg->next = NULL;
-                if (out_runnable->cmd->arg_cnt == 0)
-                    out_runnable->cmd->args = arg;
+                if (cmd->arg_cnt == 0)
+                    cmd->args = arg;
                 else
                     last_arg->next = arg; 
                 last_arg = arg;
-                ++out_runnable->cmd->arg_cnt;
+                ++cmd->arg_cnt;
             }
         } else {
             ASSERT(tok.type == e_tt_lparen);
@@ -1224,9 +2319,68 @@ static token_t parse_runnable(
         }
     }
 
+    // Builtins may depend on the args, expanded ones are looked up when run
+    if (!RUNNABLE_IS_EMPTY(out_runnable) && out_runnable->type == e_rnt_cmd &&
+        !words_expand)
+    {
+        out_runnable->cmd->builtin = find_builtin(out_runnable->cmd);
+    }
+
     return tok;
 }
 
+// Accepts a K, M or G suffix
+static b32 parse_size(char const *s, u64 *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long long val = strtoull(s, &end, 10);
+    if (errno != 0 || end == s || s[0] == '-')
+        return false;
+
+    u32 shift = 0;
+    switch (*end) {
+    case 'G': case 'g': shift += 10; // fallthrough
+    case 'M': case 'm': shift += 10; // fallthrough
+    case 'K': case 'k': shift += 10; ++end;
+    }
+    if (*end != '\0' || val > (UINT64_MAX >> shift))
+        return false;
+    *out = (u64)val << shift;
+    return true;
+}
+
+// pipesize N cmd ... | ... sets the buffer size of this pipe only
+static void apply_pipesize_prefix(pipe_chain_node_t *pp)
+{
+    string_t const prefix = LITSTR("pipesize");
+
+    runnable_node_t *first = &pp->chain->runnable;
+    if (first->type != e_rnt_cmd || first->cmd->arg_cnt < 2 ||
+        pp->has_expansions || !str_eq(first->cmd->cmd, prefix))
+    {
+        return;
+    }
+
+    // Words are slices of the line until the plan is compiled
+    command_node_t *cmd = first->cmd;
+    string_t const arg = cmd->args->name;
+    char size_str[32];
+    u64 size;
+    if (arg.len >= sizeof(size_str))
+        return;
+    mem_cpy(size_str, arg.p, arg.len);
+    size_str[arg.len] = '\0';
+    if (!parse_size(size_str, &size) || size == 0)
+        return; // the builtin will complain
+
+    pp->pipe_size = size;
+    cmd->cmd = cmd->args->next->name;
+    cmd->args = cmd->args->next->next;
+    cmd->arg_cnt -= 2;
+    cmd->builtin = find_builtin(cmd);
+}
+
 static token_t parse_pipe_chain(
     lexer_t *lexer, pipe_chain_node_t *out_pipe_chain, arena_t *arena)
 {
@@ -1239,11 +2393,7 @@ static token_t parse_pipe_chain(
 
     do {
         sep = parse_runnable(
-            lexer, &runnable,
-            &out_pipe_chain->stdin_redir,
-            &out_pipe_chain->stdout_redir,
-            &out_pipe_chain->stdout_append_redir,
-            arena);
+            lexer, &runnable, out_pipe_chain, arena);
 
         if (tok_is_error(sep))
             break;
@@ -1265,13 +2415,8 @@ static token_t parse_pipe_chain(
         ++out_pipe_chain->cmd_cnt;
     } while (sep.type == e_tt_pipe);
 
-    if (!tok_is_error(sep)) {
-        int pipe_cd_res = check_if_pipe_is_cd(out_pipe_chain);
-        if (pipe_cd_res == c_is_cd) 
-            out_pipe_chain->is_cd = true;
-        if (pipe_cd_res == c_invalid_cd) // @TODO: elaborate
-            sep.type = e_tt_parser_error;
-    }
+    if (!tok_is_error(sep) && !CHAIN_IS_EMPTY(out_pipe_chain))
+        apply_pipesize_prefix(out_pipe_chain);
 
     return sep;
 }
@@ -1281,6 +2426,19 @@ static token_t parse_cond_chain(
 {
     CLEAR(out_cond_chain);
 
+    // A keyword rather than a builtin so that it covers the whole chain
+    string_t const time_kw = LITSTR("time");
+    u64 const pos = lexer->pos;
+    u64 const mark = arena->allocated;
+    token_t const first = get_next_token(lexer, arena);
+    if (first.type == e_tt_ident && !first.expand &&
+        str_eq(first.id, time_kw))
+        out_cond_chain->timed = true;
+    else {
+        lexer->pos = pos;
+        arena->allocated = mark;
+    }
+
     pipe_chain_node_t pp = {0};
     cond_node_t *last_cond = NULL;
 
@@ -1358,9 +2516,12 @@ static token_t parse_uncond_chain(
     return sep;
 }
 
-static root_node_t *parse_line(string_t line, arena_t *arena)
+// The heredocs of the line are left in out_docs for the caller to read
+// the bodies of, NULL if the source has no lines after this one
+static root_node_t *parse_line(
+    string_t line, stdin_doc_t **out_docs, arena_t *arena)
 {
-    lexer_t lexer = {line, 0};
+    lexer_t lexer = {line, 0, NULL, NULL};
 
     uncond_chain_node_t *node = ARENA_ALLOC(arena, uncond_chain_node_t);
     token_t sep = parse_uncond_chain(&lexer, node, arena);
@@ -1377,250 +2538,4432 @@ static root_node_t *parse_line(string_t line, arena_t *arena)
 
     ASSERT(sep.type == e_tt_eol);
 
+    if (lexer.pending_docs && !out_docs) {
+        fprintf(stderr, "Parser error: no lines for a heredoc body\n");
+        return NULL;
+    } else if (out_docs)
+        *out_docs = lexer.pending_docs;
+
     return node;
 }
 
-typedef int fd_pair_t[2]; 
+// Shell variables, the environment is imported into them on startup.
+// The envp for children is only rebuilt after an exported one has changed.
+typedef struct var {
+    string_t name;  // name.p == NULL means an empty slot
+    string_t value; // '\0'-terminated, p == NULL if only declared
+    u32 value_cap;
+    b32 exported;
+    u64 changed_gen;
+} var_t;
+
+typedef struct var_store {
+    arena_t *arena; // names and values
+    var_t *slots;
+    u32 cap; // power of 2
+    u32 cnt;
 
-void sigchld_handler(int sig)
-{
-    (void)sig;
-    signal(SIGCHLD, sigchld_handler);
-    while (wait4(-1, NULL, WNOHANG, NULL) > 0)
-        ;
-}
+    u64 gen;     // bumped by every change
+    u64 env_gen; // of the last change to the environment
 
-static void detach_group()
+    arena_t env_arena; // only holds envp, dropped on rebuild
+    char **envp;
+    u64 envp_gen;
+} var_store_t;
+
+static var_store_t g_vars = {0};
+
+static var_t *var_find_slot(var_t *slots, u32 cap, string_t name)
 {
-    pid_t pid = getpid();
-    setpgid(pid, pid);
+    u32 const mask = cap - 1;
+    for (u32 i = (u32)str_hash(name) & mask;; i = (i + 1) & mask) {
+        if (!string_is_valid(&slots[i].name) || str_eq(slots[i].name, name))
+            return &slots[i];
+    }
 }
 
-static void set_pgroup_as_term_fg()
+static var_t *var_lookup(var_store_t *store, string_t name)
 {
-    signal(SIGTTOU, SIG_IGN); // otherwise tcsetpgrp will freeze it
-    tcsetpgrp(STDIN_FILENO, getpgid(getpid()));
-    signal(SIGTTOU, SIG_DFL);
+    var_t *var = var_find_slot(store->slots, store->cap, name);
+    return string_is_valid(&var->name) ? var : NULL;
 }
 
-static int await_processes(pid_t const *pids, int count)
+static var_t *var_add(var_store_t *store, string_t name)
 {
-    for (;;) {
-        int status;
-        int wr = waitpid(-1, &status, 0);
-        ASSERT(wr > 0);
-        
-        if (wr == pids[count - 1]) {
-            // This also collects everithing before sigchld was reinstated
-            sigchld_handler(0);
-            return WIFEXITED(status) ? WEXITSTATUS(status) : -2;
+    if ((store->cnt + 1) * 2 > store->cap) {
+        u32 const new_cap = store->cap * 2;
+        var_t *new_slots = ARENA_ALLOC_N(store->arena, var_t, new_cap);
+        mem_clear(new_slots, new_cap * sizeof(*new_slots));
+        for (u32 i = 0; i < store->cap; ++i) {
+            var_t const *v = &store->slots[i];
+            if (string_is_valid(&v->name))
+                *var_find_slot(new_slots, new_cap, v->name) = *v;
         }
+        store->slots = new_slots;
+        store->cap = new_cap;
+    }
+
+    var_t *var = var_find_slot(store->slots, store->cap, name);
+    if (!string_is_valid(&var->name)) {
+        CLEAR(var);
+        var->name.p = ARENA_ALLOC_N(store->arena, char, name.len);
+        var->name.len = name.len;
+        mem_cpy(var->name.p, name.p, name.len);
+        ++store->cnt;
     }
+    return var;
 }
 
-static void close_fd_pair(fd_pair_t pair)
+static void var_changed(var_store_t *store, var_t *var)
 {
-    if (pair[0] != STDIN_FILENO)
-        close(pair[0]);
-    if (pair[1] != STDOUT_FILENO)
-        close(pair[1]);
-    pair[0] = STDIN_FILENO;
-    pair[1] = STDOUT_FILENO;
+    var->changed_gen = ++store->gen;
+    if (var->exported)
+        store->env_gen = store->gen;
 }
 
-static void close_fd_pairs(fd_pair_t *pairs, int count)
+static var_t *var_set(var_store_t *store, string_t name, string_t value)
 {
-    for (fd_pair_t *p = pairs; p != pairs + count; ++p)
-        close_fd_pair(*p);
+    var_t *var = var_add(store, name);
+    // Assignments in a loop reuse the buffer
+    if (value.len + 1 > var->value_cap) {
+        var->value_cap = MAX((u32)value.len + 1, 2 * var->value_cap);
+        var->value.p = ARENA_ALLOC_N(store->arena, char, var->value_cap);
+    }
+    mem_cpy(var->value.p, value.p, value.len);
+    var->value.p[value.len] = '\0';
+    var->value.len = value.len;
+    var_changed(store, var);
+    return var;
 }
 
-static int execute_uncond_chain(uncond_chain_node_t const *, b32, arena_t *);
-
-static pid_t execute_runnable(
-    runnable_node_t const *runnable,
-    fd_pair_t *io_fd_pairs, int fd_pair_cnt,
-    int proc_id, arena_t *arena)
+static void var_export(var_store_t *store, string_t name)
 {
-    pid_t pid = fork();
-    if (pid == 0) {
-        signal(SIGCHLD, SIG_DFL);
+    var_t *var = var_add(store, name);
+    if (!var->exported) {
+        var->exported = true;
+        var_changed(store, var);
+    }
+}
 
-        if (io_fd_pairs[proc_id][0] != STDIN_FILENO)
-            dup2(io_fd_pairs[proc_id][0], STDIN_FILENO);
-        if (io_fd_pairs[proc_id][1] != STDOUT_FILENO)
-            dup2(io_fd_pairs[proc_id][1], STDOUT_FILENO);
+// Invalid if not set
+static string_t var_get(var_store_t *store, string_t name)
+{
+    string_t res = {0};
+    var_t const *var = var_lookup(store, name);
+    if (var)
+        res = var->value;
+    return res;
+}
 
-        close_fd_pairs(io_fd_pairs, fd_pair_cnt);
+static char **var_store_envp(var_store_t *store)
+{
+    if (store->envp && store->envp_gen == store->env_gen)
+        return store->envp;
+
+    arena_drop(&store->env_arena);
+    u32 cnt = 0;
+    for (u32 i = 0; i < store->cap; ++i) {
+        var_t const *v = &store->slots[i];
+        cnt += string_is_valid(&v->name) && v->exported &&
+            string_is_valid(&v->value);
+    }
 
-        if (RUNNABLE_IS_EMPTY(runnable)) {
-            _exit(0);
-        } else if (runnable->type == e_rnt_cmd) {
-            command_node_t const *cmd = runnable->cmd;
-            char **argv = ARENA_ALLOC_N(arena, char *, cmd->arg_cnt + 2);
-            argv[0] = cmd->cmd.p;
-            u64 i = 1;
-            for (arg_node_t *arg = cmd->args; arg; arg = arg->next)
-                argv[i++] = arg->name.p;
-            argv[i] = NULL;
-
-            execvp(argv[0], argv);
-            perror(argv[0]);
-            _exit(1);
-        } else {
-            _exit(execute_uncond_chain(runnable->subshell, false, arena));
+    char **envp = ARENA_ALLOC_N(&store->env_arena, char *, cnt + 1);
+    char **out = envp;
+    for (u32 i = 0; i < store->cap; ++i) {
+        var_t const *v = &store->slots[i];
+        if (!string_is_valid(&v->name) || !v->exported ||
+            !string_is_valid(&v->value))
+        {
+            continue;
         }
+        char *entry = ARENA_ALLOC_N(
+            &store->env_arena, char, v->name.len + v->value.len + 2);
+        mem_cpy(entry, v->name.p, v->name.len);
+        entry[v->name.len] = '=';
+        mem_cpy(entry + v->name.len + 1, v->value.p, v->value.len + 1);
+        *out++ = entry;
     }
+    *out = NULL;
 
-    close_fd_pair(io_fd_pairs[proc_id]);
-    return pid;
+    store->envp = envp;
+    store->envp_gen = store->env_gen;
+    // For whatever still reads the environment, like execvp
+    environ = envp;
+    return envp;
 }
 
-static int execute_pipe_in_subprocess(
-    pipe_chain_node_t const *pp, arena_t *arena)
+static b32 init_var_store(var_store_t *store, arena_t *arena)
 {
-    ASSERT(!CHAIN_IS_EMPTY(pp));
+    if (!arena_init(&store->env_arena, "env", c_env_mem_size))
+        return false;
+
+    store->arena = arena;
+    store->cap = c_var_store_initial_cap;
+    store->slots = ARENA_ALLOC_N(arena, var_t, store->cap);
+    mem_clear(store->slots, store->cap * sizeof(*store->slots));
+
+    for (char **e = environ; *e; ++e) {
+        char *eq = strchr(*e, '=');
+        if (!eq)
+            continue;
+        string_t const name = {*e, eq - *e};
+        var_export(store, name);
+        var_set(store, name, str_from_cstr(eq + 1));
+    }
+    return true;
+}
 
-    int elem_cnt = pp->cmd_cnt;
-    pid_t *pids = ARENA_ALLOC_N(arena, pid_t, elem_cnt);
-    fd_pair_t *io_fd_pairs = ARENA_ALLOC_N(arena, fd_pair_t, elem_cnt);
+static void release_var_store(var_store_t *store)
+{
+    arena_release(&store->env_arena);
+    store->envp = NULL;
+}
 
-    for (int i = 0; i < elem_cnt; ++i) {
-        pids[i] = -1;
-        io_fd_pairs[i][0] = STDIN_FILENO;
-        io_fd_pairs[i][1] = STDOUT_FILENO;
-    }
+static b32 same_var_name(char const *a, char const *b)
+{
+    while (*a && *a != '=' && *a == *b)
+        ++a, ++b;
+    return (*a == '=' || !*a) && (*b == '=' || !*b);
+}
 
-    if (string_is_valid(&pp->stdin_redir))
-        io_fd_pairs[0][0] = open(pp->stdin_redir.p, O_RDONLY);
-    if (string_is_valid(&pp->stdout_redir)) {
-        io_fd_pairs[elem_cnt - 1][1] = open(
-            pp->stdout_redir.p, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    } else if (string_is_valid(&pp->stdout_append_redir)) {
-        io_fd_pairs[elem_cnt - 1][1] = open(
-            pp->stdout_append_redir.p, O_WRONLY | O_CREAT | O_APPEND, 0644);
+// The exported variables with the command's own assignments on top, the
+// last of those wins
+static char **command_envp(command_node_t const *cmd, arena_t *arena)
+{
+    char **base = var_store_envp(&g_vars);
+    if (cmd->assign_cnt == 0)
+        return base;
+
+    u64 base_cnt = 0;
+    while (base[base_cnt])
+        ++base_cnt;
+    char **envp = ARENA_ALLOC_N(arena, char *, base_cnt + cmd->assign_cnt + 1);
+    u64 cnt = 0;
+    for (u64 i = 0; i < base_cnt; ++i) {
+        arg_node_t const *a = cmd->assigns;
+        while (a && !same_var_name(a->name.p, base[i]))
+            a = a->next;
+        if (!a)
+            envp[cnt++] = base[i];
     }
+    for (arg_node_t const *a = cmd->assigns; a; a = a->next) {
+        arg_node_t const *later = a->next;
+        while (later && !same_var_name(later->name.p, a->name.p))
+            later = later->next;
+        if (!later)
+            envp[cnt++] = a->name.p;
+    }
+    envp[cnt] = NULL;
+    return envp;
+}
 
-    if (io_fd_pairs[0][0] < 0 || io_fd_pairs[elem_cnt - 1][1] < 0) {
-        close_fd_pairs(io_fd_pairs, elem_cnt);
-        return -2;
+// A command of only assignments sets shell variables
+static int assign_vars(command_node_t const *cmd)
+{
+    for (arg_node_t const *a = cmd->assigns; a; a = a->next) {
+        u64 name_len = 0;
+        b32 const ok = is_assignment(a->name, &name_len);
+        ASSERT(ok);
+        (void)ok;
+        string_t const name = {a->name.p, name_len};
+        string_t const value = {
+            a->name.p + name_len + 1, a->name.len - name_len - 1};
+        var_set(&g_vars, name, value);
     }
+    return 0;
+}
 
-    for (int i = 0; i < elem_cnt - 1; ++i) {
-        fd_pair_t fds = {0};
-        int res = pipe(fds);
-        if (res != 0) {
-            close_fd_pairs(io_fd_pairs, elem_cnt);
-            return -2;
-        }
+typedef struct cmd_hash_entry {
+    string_t name;
+    string_t path; // '\0'-terminated
+    u32 hits;
+} cmd_hash_entry_t;
+
+// Like bash's hash: command name -> absolute path, so children can execve
+// directly instead of letting execvp try every PATH dir.
+// Everything lives in its own arena, which is just dropped on reset.
+typedef struct cmd_hash {
+    arena_t arena;
+    b32 enabled;
+
+    cmd_hash_entry_t *slots; // name.p == NULL means empty
+    u32 cap;                 // power of 2
+    u32 cnt;
 
-        io_fd_pairs[i + 1][0] = fds[0];
-        io_fd_pairs[i][1] = fds[1];
-    }
+    u64 path_gen; // of the PATH the table was filled for
+} cmd_hash_t;
 
-    signal(SIGCHLD, SIG_DFL);
+static cmd_hash_t g_cmd_hash = {0};
 
-    int launched_proc_cnt = 0;
-    for (pipe_node_t *elem = pp->chain; elem; elem = elem->next) {
-        int this_proc_index = launched_proc_cnt++;
+static void cmd_hash_reset(cmd_hash_t *hash)
+{
+    arena_drop(&hash->arena);
+    hash->cap = c_cmd_hash_initial_cap;
+    hash->cnt = 0;
+    hash->slots = ARENA_ALLOC_N(&hash->arena, cmd_hash_entry_t, hash->cap);
+    mem_clear(hash->slots, hash->cap * sizeof(*hash->slots));
+    hash->path_gen = 0;
+}
+
+static void init_cmd_hash(cmd_hash_t *hash)
+{
+    hash->enabled = arena_init(&hash->arena, "cmd-hash", c_cmd_hash_mem_size);
+    if (hash->enabled)
+        cmd_hash_reset(hash);
+}
+
+static void release_cmd_hash(cmd_hash_t *hash)
+{
+    if (hash->enabled)
+        arena_release(&hash->arena);
+    hash->enabled = false;
+}
+
+static cmd_hash_entry_t *cmd_hash_find_slot(
+    cmd_hash_entry_t *slots, u32 cap, string_t name)
+{
+    u32 const mask = cap - 1;
+    for (u32 i = (u32)str_hash(name) & mask;; i = (i + 1) & mask) {
+        if (!string_is_valid(&slots[i].name) || str_eq(slots[i].name, name))
+            return &slots[i];
+    }
+}
+
+static cmd_hash_entry_t *cmd_hash_add_slot(cmd_hash_t *hash, string_t name)
+{
+    if ((hash->cnt + 1) * 2 > hash->cap) {
+        u32 const new_cap = hash->cap * 2;
+        cmd_hash_entry_t *new_slots =
+            ARENA_ALLOC_N(&hash->arena, cmd_hash_entry_t, new_cap);
+        mem_clear(new_slots, new_cap * sizeof(*new_slots));
+        for (u32 i = 0; i < hash->cap; ++i) {
+            cmd_hash_entry_t const *e = &hash->slots[i];
+            if (string_is_valid(&e->name))
+                *cmd_hash_find_slot(new_slots, new_cap, e->name) = *e;
+        }
+        hash->slots = new_slots;
+        hash->cap = new_cap;
+    }
+
+    cmd_hash_entry_t *slot = cmd_hash_find_slot(hash->slots, hash->cap, name);
+    if (!string_is_valid(&slot->name)) {
+        slot->name.p = ARENA_ALLOC_N(&hash->arena, char, name.len);
+        slot->name.len = name.len;
+        mem_cpy(slot->name.p, name.p, name.len);
+        slot->hits = 0;
+        ++hash->cnt;
+    }
+    return slot;
+}
+
+static b32 is_executable_file(char const *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(path, X_OK) == 0;
+}
+
+// Does the same PATH walk as execvp, but in the parent and only once
+static string_t search_path_for_command(
+    string_t name, string_t path_var, arena_t *arena)
+{
+    string_t res = {0};
+    char const *p = path_var.p;
+    char const *end = path_var.p + path_var.len;
+    while (p <= end) {
+        char const *dir_end = p;
+        while (dir_end != end && *dir_end != ':')
+            ++dir_end;
+
+        // Empty entries mean the current dir
+        string_t dir = {(char *)p, dir_end - p};
+        string_t const cwd = LITSTR(".");
+        if (dir.len == 0)
+            dir = cwd;
+
+        u64 const mark = arena->allocated;
+        res.len = dir.len + 1 + name.len;
+        res.p = ARENA_ALLOC_N(arena, char, res.len + 1);
+        mem_cpy(res.p, dir.p, dir.len);
+        res.p[dir.len] = '/';
+        mem_cpy(res.p + dir.len + 1, name.p, name.len);
+        res.p[res.len] = '\0';
+
+        if (is_executable_file(res.p))
+            return res;
+
+        arena->allocated = mark;
+        p = dir_end + 1;
+    }
+
+    clear_string(&res);
+    return res;
+}
+
+// Like the command hash, completion follows PATH through its generation
+static void term_sync_path(terminal_session_t *term)
+{
+    string_t const path_name = LITSTR("PATH");
+    var_t const *path = var_lookup(&g_vars, path_name);
+    u64 const gen = path ? path->changed_gen : 0;
+    if (gen == term->path_gen)
+        return;
+
+    string_t path_var = {0};
+    if (path && string_is_valid(&path->value))
+        path_var = path->value;
+    term_load_path(term, path_var, gen);
+}
+
+// Returns NULL if it has to be left to execvp
+static char const *cmd_hash_resolve(cmd_hash_t *hash, string_t name)
+{
+    if (!hash->enabled || str_has_chr(name, '/'))
+        return NULL;
+
+    string_t const path_name = LITSTR("PATH");
+    var_t const *path = var_lookup(&g_vars, path_name);
+    if (!path || !string_is_valid(&path->value))
+        return NULL;
+    string_t const path_var = path->value;
+
+    if (hash->path_gen != path->changed_gen) {
+        cmd_hash_reset(hash);
+        hash->path_gen = path->changed_gen;
+    }
+
+    cmd_hash_entry_t *slot = cmd_hash_find_slot(hash->slots, hash->cap, name);
+    if (string_is_valid(&slot->name)) {
+        // The cached binary may have been removed since
+        if (access(slot->path.p, X_OK) == 0) {
+            ++slot->hits;
+            return slot->path.p;
+        }
+    }
+
+    string_t found = search_path_for_command(name, path_var, &hash->arena);
+    if (!string_is_valid(&found))
+        return NULL;
+
+    slot = cmd_hash_add_slot(hash, name);
+    slot->path = found;
+    ++slot->hits;
+    return slot->path.p;
+}
+
+typedef int fd_pair_t[2]; 
+
+static void close_fd_pair(fd_pair_t pair)
+{
+    if (pair[0] != STDIN_FILENO)
+        close(pair[0]);
+    if (pair[1] != STDOUT_FILENO)
+        close(pair[1]);
+    pair[0] = STDIN_FILENO;
+    pair[1] = STDOUT_FILENO;
+}
+
+static void close_fd_pairs(fd_pair_t *pairs, int count)
+{
+    for (fd_pair_t *p = pairs; p != pairs + count; ++p)
+        close_fd_pair(*p);
+}
+
+static char **build_argv(command_node_t const *cmd, arena_t *arena)
+{
+    if (cmd->argv)
+        return cmd->argv;
+
+    char **argv = ARENA_ALLOC_N(arena, char *, cmd->arg_cnt + 2);
+    argv[0] = cmd->cmd.p;
+    u64 i = 1;
+    for (arg_node_t *arg = cmd->args; arg; arg = arg->next)
+        argv[i++] = arg->name.p;
+    argv[i] = NULL;
+    return argv;
+}
+
+enum {
+    c_plan_cache_mem_size = 256 * 1024 * 1024,
+    c_plan_cache_max_bytes = 32 * 1024 * 1024, // then it starts over
+    c_plan_cache_cap = 4096 // slots, it starts over when half are used
+};
+
+// Parsed lines compiled into one contiguous block each and kept by the
+// line text. The nodes are laid out in the order they run in, strings are
+// NUL-terminated and commands without expansions get their argv prebuilt,
+// so a repeated line skips the lexer, the parser and building the argv.
+// Expansions still happen when the pipe runs. Lines with heredocs are not
+// kept, their bodies come from the lines after. Those are compiled into
+// the line arena, as the words of a parsed line are only slices of it.
+typedef struct plan {
+    string_t line; // p == NULL for an empty slot
+    u64 hash;
+    root_node_t const *root;
+} plan_t;
+
+typedef struct plan_cache {
+    arena_t arena;
+    plan_t *slots; // c_plan_cache_cap of them
+    u32 cnt;
+    b32 enabled;
+} plan_cache_t;
+
+static plan_cache_t g_plans = {0};
+
+static void plan_cache_reset(plan_cache_t *cache)
+{
+    arena_drop(&cache->arena);
+    cache->slots = ARENA_ALLOC_N(&cache->arena, plan_t, c_plan_cache_cap);
+    mem_clear(cache->slots, c_plan_cache_cap * sizeof(plan_t));
+    cache->cnt = 0;
+}
+
+static void init_plan_cache(plan_cache_t *cache)
+{
+    cache->enabled =
+        arena_init(&cache->arena, "plans", c_plan_cache_mem_size);
+    if (cache->enabled)
+        plan_cache_reset(cache);
+}
+
+static void release_plan_cache(plan_cache_t *cache)
+{
+    if (cache->enabled)
+        arena_release(&cache->arena);
+    cache->enabled = false;
+}
+
+static plan_t *plan_cache_find_slot(
+    plan_cache_t *cache, string_t line, u64 hash)
+{
+    u32 const mask = c_plan_cache_cap - 1;
+    for (u32 i = (u32)hash & mask;; i = (i + 1) & mask) {
+        plan_t *plan = &cache->slots[i];
+        if (!plan->line.p || (plan->hash == hash && str_eq(plan->line, line)))
+            return plan;
+    }
+}
+
+static root_node_t const *plan_cache_get(
+    plan_cache_t *cache, string_t line, u64 hash)
+{
+    if (!cache->enabled)
+        return NULL;
+    return plan_cache_find_slot(cache, line, hash)->root;
+}
+
+static string_t plan_copy_str(string_t s, arena_t *arena)
+{
+    if (!string_is_valid(&s))
+        return s;
+    string_t res = {ARENA_ALLOC_N(arena, char, s.len + 1), s.len};
+    mem_cpy(res.p, s.p, s.len);
+    res.p[s.len] = '\0';
+    return res;
+}
+
+static arg_node_t *plan_copy_args(
+    arg_node_t const *list, u64 cnt, arena_t *arena)
+{
+    if (cnt == 0)
+        return NULL;
+    arg_node_t *res = ARENA_ALLOC_N(arena, arg_node_t, cnt);
+    u64 i = 0;
+    for (arg_node_t const *a = list; a; a = a->next, ++i) {
+        res[i].name = plan_copy_str(a->name, arena);
+        res[i].expand = a->expand;
+        res[i].next = a->next ? &res[i + 1] : NULL;
+    }
+    return res;
+}
+
+static command_node_t *plan_copy_command(
+    command_node_t const *cmd, arena_t *arena)
+{
+    command_node_t *res = ARENA_ALLOC(arena, command_node_t);
+    *res = *cmd;
+    res->cmd = plan_copy_str(cmd->cmd, arena);
+    res->args = plan_copy_args(cmd->args, cmd->arg_cnt, arena);
+    res->assigns = plan_copy_args(cmd->assigns, cmd->assign_cnt, arena);
+
+    b32 expands = cmd->cmd_expand;
+    for (arg_node_t const *arg = cmd->args; arg; arg = arg->next)
+        expands |= arg->expand;
+    if (string_is_valid(&res->cmd) && !expands)
+        res->argv = build_argv(res, arena);
+    return res;
+}
+
+static void plan_copy_uncond_chain(
+    uncond_chain_node_t *dst, uncond_chain_node_t const *src, arena_t *arena);
+
+static void plan_copy_pipe_chain(
+    pipe_chain_node_t *dst, pipe_chain_node_t const *src, arena_t *arena)
+{
+    *dst = *src;
+    dst->stdin_redir = plan_copy_str(src->stdin_redir, arena);
+    dst->stdout_redir = plan_copy_str(src->stdout_redir, arena);
+    dst->stdout_append_redir = plan_copy_str(src->stdout_append_redir, arena);
+    if (src->stdin_doc) {
+        stdin_doc_t *doc = ARENA_ALLOC(arena, stdin_doc_t);
+        *doc = *src->stdin_doc;
+        doc->text = plan_copy_str(doc->text, arena);
+        doc->delim = plan_copy_str(doc->delim, arena);
+        doc->next_pending = NULL;
+        dst->stdin_doc = doc;
+    }
+
+    pipe_node_t *elems = ARENA_ALLOC_N(arena, pipe_node_t, src->cmd_cnt);
+    u64 i = 0;
+    for (pipe_node_t const *e = src->chain; e; e = e->next, ++i) {
+        runnable_node_t *r = &elems[i].runnable;
+        r->type = e->runnable.type;
+        if (r->type == e_rnt_cmd)
+            r->cmd = plan_copy_command(e->runnable.cmd, arena);
+        else {
+            r->subshell = ARENA_ALLOC(arena, uncond_chain_node_t);
+            plan_copy_uncond_chain(r->subshell, e->runnable.subshell, arena);
+        }
+        elems[i].next = e->next ? &elems[i + 1] : NULL;
+    }
+    dst->chain = src->chain ? elems : NULL;
+}
+
+static void plan_copy_cond_chain(
+    cond_chain_node_t *dst, cond_chain_node_t const *src, arena_t *arena)
+{
+    *dst = *src;
+    cond_node_t *conds = ARENA_ALLOC_N(arena, cond_node_t, src->cond_cnt);
+    u64 i = 0;
+    for (cond_node_t const *c = src->chain; c; c = c->next, ++i) {
+        plan_copy_pipe_chain(&conds[i].pp, &c->pp, arena);
+        conds[i].link = c->link;
+        conds[i].next = c->next ? &conds[i + 1] : NULL;
+    }
+    dst->chain = src->chain ? conds : NULL;
+}
+
+static void plan_copy_uncond_chain(
+    uncond_chain_node_t *dst, uncond_chain_node_t const *src, arena_t *arena)
+{
+    *dst = *src;
+    uncond_node_t *unconds =
+        ARENA_ALLOC_N(arena, uncond_node_t, src->uncond_cnt);
+    u64 i = 0;
+    for (uncond_node_t const *u = src->chain; u; u = u->next, ++i) {
+        plan_copy_cond_chain(&unconds[i].cond, &u->cond, arena);
+        unconds[i].link = u->link;
+        unconds[i].next = u->next ? &unconds[i + 1] : NULL;
+    }
+    dst->chain = src->chain ? unconds : NULL;
+}
+
+static root_node_t const *compile_plan(
+    root_node_t const *root, arena_t *arena)
+{
+    root_node_t *plan = ARENA_ALLOC(arena, root_node_t);
+    plan_copy_uncond_chain(plan, root, arena);
+    return plan;
+}
+
+// The kept plan of root, or one in arena if it can't be kept
+static root_node_t const *plan_cache_add(
+    plan_cache_t *cache, string_t line, u64 hash, root_node_t const *root,
+    arena_t *arena)
+{
+    if (!cache->enabled)
+        return compile_plan(root, arena);
+    if (cache->arena.allocated + line.len > c_plan_cache_max_bytes ||
+        2 * (cache->cnt + 1) > c_plan_cache_cap)
+    {
+        plan_cache_reset(cache);
+    }
+
+    plan_t *plan = plan_cache_find_slot(cache, line, hash);
+    if (!plan->line.p) {
+        ++cache->cnt;
+        plan->line = plan_copy_str(line, &cache->arena);
+        plan->hash = hash;
+        plan->root = compile_plan(root, &cache->arena);
+    }
+    return plan->root;
+}
+
+enum {
+    c_fd_writer_buf_size = 4096
+};
+
+// Builtins write through this instead of stdio, so that nothing is left
+// buffered in the shell itself when the target is a redirect or a pipe
+typedef struct fd_writer {
+    int fd;
+    b32 failed;
+    u32 len;
+    char buf[c_fd_writer_buf_size];
+} fd_writer_t;
+
+static void fdw_init(fd_writer_t *w, int fd)
+{
+    w->fd = fd;
+    w->failed = false;
+    w->len = 0;
+}
+
+static b32 fdw_flush(fd_writer_t *w)
+{
+    char const *p = w->buf;
+    while (!w->failed && p != w->buf + w->len) {
+        ssize_t written = write(w->fd, p, w->buf + w->len - p);
+        if (written < 0 && errno == EINTR)
+            continue;
+        else if (written < 0)
+            w->failed = true;
+        else
+            p += written;
+    }
+    w->len = 0;
+    return !w->failed;
+}
+
+static void fdw_write(fd_writer_t *w, char const *p, u64 len)
+{
+    while (len > 0) {
+        if (w->len == sizeof(w->buf))
+            fdw_flush(w);
+        u64 chunk = sizeof(w->buf) - w->len;
+        if (chunk > len)
+            chunk = len;
+        mem_cpy(w->buf + w->len, p, chunk);
+        w->len += chunk;
+        p += chunk;
+        len -= chunk;
+    }
+}
+
+static void fdw_printf(fd_writer_t *w, char const *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    u32 const space = sizeof(w->buf) - w->len;
+    int const len = vsnprintf(w->buf + w->len, space, fmt, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if ((u32)len < space) {
+        w->len += len;
+        return;
+    }
+
+    fdw_flush(w);
+    va_start(args, fmt);
+    if ((u32)len < sizeof(w->buf))
+        w->len = vsnprintf(w->buf, sizeof(w->buf), fmt, args);
+    else if (vdprintf(w->fd, fmt, args) < 0) // too long to buffer
+        w->failed = true;
+    va_end(args);
+}
+
+enum {
+    c_cmd_desc_len = 128
+};
+
+// Short one-line rendering of a command for reports
+typedef struct cmd_desc {
+    char buf[c_cmd_desc_len];
+    u32 len;
+} cmd_desc_t;
+
+typedef enum job_state {
+    e_js_running,
+    e_js_stopped,
+    e_js_done
+} job_state_t;
+
+typedef struct job_proc {
+    pid_t pid;
+    job_state_t state;
+    int status; // last wait status
+    struct rusage ru; // from wait4 once it is done
+} job_proc_t;
+
+typedef struct job {
+    u32 id;
+    pid_t pgid; // 0 if the job shares the shell's group
+    job_state_t state;
+    struct timespec start;
+    cmd_desc_t desc;
+
+    // Terminal modes of a job stopped in the foreground
+    struct termios tmodes;
+    b32 has_tmodes;
+
+    // Innermost measurement running when it was launched, or NULL
+    struct run_cost *cost;
+
+    struct job *next;
+    u32 proc_cnt;
+    job_proc_t procs[];
+} job_t;
+
+// Sorted by id, which is the smallest free one on creation
+typedef struct job_table {
+    job_t *first;
+    u32 current;
+
+    struct termios shell_tmodes;
+    b32 has_shell_tmodes;
+} job_table_t;
+
+static job_table_t g_jobs = {0};
+static b32 g_job_control = false;
+
+static void detach_group()
+{
+    pid_t pid = getpid();
+    setpgid(pid, pid);
+}
+
+static void set_term_fg(pid_t pgid)
+{
+    // otherwise tcsetpgrp will freeze it
+    void (*prev)(int) = signal(SIGTTOU, SIG_IGN);
+    tcsetpgrp(STDIN_FILENO, pgid);
+    signal(SIGTTOU, prev);
+}
+
+static void set_pgroup_as_term_fg()
+{
+    set_term_fg(getpgid(getpid()));
+}
+
+static void desc_append(cmd_desc_t *desc, char const *p, u64 len)
+{
+    u64 const room = c_cmd_desc_len - 1 - desc->len;
+    if (len > room)
+        len = room;
+    mem_cpy(desc->buf + desc->len, p, len);
+    desc->len += len;
+    desc->buf[desc->len] = '\0';
+}
+
+#define DESC_APPEND_LIT(desc_, lit_) \
+    desc_append((desc_), (lit_), sizeof(lit_) - 1)
+
+static void describe_uncond_chain(cmd_desc_t *, uncond_chain_node_t const *);
+
+static void describe_pipe_chain(
+    cmd_desc_t *desc, pipe_chain_node_t const *pp)
+{
+    for (pipe_node_t const *elem = pp->chain; elem; elem = elem->next) {
+        if (elem != pp->chain)
+            DESC_APPEND_LIT(desc, " | ");
+
+        runnable_node_t const *r = &elem->runnable;
+        if (RUNNABLE_IS_EMPTY(r))
+            continue;
+        else if (r->type == e_rnt_subshell) {
+            DESC_APPEND_LIT(desc, "(");
+            describe_uncond_chain(desc, r->subshell);
+            DESC_APPEND_LIT(desc, ")");
+            continue;
+        }
+
+        b32 const has_cmd = string_is_valid(&r->cmd->cmd);
+        for (arg_node_t const *a = r->cmd->assigns; a; a = a->next) {
+            desc_append(desc, a->name.p, a->name.len);
+            if (a->next || has_cmd)
+                DESC_APPEND_LIT(desc, " ");
+        }
+        if (has_cmd)
+            desc_append(desc, r->cmd->cmd.p, r->cmd->cmd.len);
+        for (arg_node_t const *arg = r->cmd->args; arg; arg = arg->next) {
+            DESC_APPEND_LIT(desc, " ");
+            desc_append(desc, arg->name.p, arg->name.len);
+        }
+    }
+
+    if (string_is_valid(&pp->stdin_redir)) {
+        DESC_APPEND_LIT(desc, " < ");
+        desc_append(desc, pp->stdin_redir.p, pp->stdin_redir.len);
+    } else if (pp->stdin_doc && pp->stdin_doc->is_word) {
+        DESC_APPEND_LIT(desc, " <<< ");
+        desc_append(desc, pp->stdin_doc->text.p, pp->stdin_doc->text.len);
+    } else if (pp->stdin_doc) {
+        DESC_APPEND_LIT(desc, " << ");
+        desc_append(desc, pp->stdin_doc->delim.p, pp->stdin_doc->delim.len);
+    }
+    if (string_is_valid(&pp->stdout_redir)) {
+        DESC_APPEND_LIT(desc, " > ");
+        desc_append(desc, pp->stdout_redir.p, pp->stdout_redir.len);
+    } else if (string_is_valid(&pp->stdout_append_redir)) {
+        DESC_APPEND_LIT(desc, " >> ");
+        desc_append(
+            desc, pp->stdout_append_redir.p, pp->stdout_append_redir.len);
+    }
+}
+
+static void describe_cond_chain(
+    cmd_desc_t *desc, cond_chain_node_t const *chain)
+{
+    if (chain->timed)
+        DESC_APPEND_LIT(desc, "time ");
+    for (cond_node_t const *cond = chain->chain; cond; cond = cond->next) {
+        describe_pipe_chain(desc, &cond->pp);
+        if (cond->link == e_cl_if_success)
+            DESC_APPEND_LIT(desc, " && ");
+        else if (cond->link == e_cl_if_failed)
+            DESC_APPEND_LIT(desc, " || ");
+    }
+}
+
+static void describe_uncond_chain(
+    cmd_desc_t *desc, uncond_chain_node_t const *chain)
+{
+    for (uncond_node_t const *u = chain->chain; u; u = u->next) {
+        describe_cond_chain(desc, &u->cond);
+        if (u->link == e_ul_bg)
+            DESC_APPEND_LIT(desc, u->next ? " & " : " &");
+        else if (u->next)
+            DESC_APPEND_LIT(desc, "; ");
+    }
+}
+
+enum {
+    c_trace_name_len = 96,
+    c_trace_max_events = 1 << 20,
+    c_trace_max_open = 64
+};
+
+typedef enum trace_kind {
+    e_tk_parse,
+    e_tk_uncond,
+    e_tk_cond,
+    e_tk_pipe,
+    e_tk_fork,
+    e_tk_spawn,
+    e_tk_exec,
+    e_tk_wait,
+    e_tk_reap
+} trace_kind_t;
+
+// Category and the names of the (up to two) integer args of an event kind
+static struct {
+    char const *cat;
+    char const *arg_names[2];
+} const c_trace_kinds[] = {
+    [e_tk_parse] = {"parse", {NULL, NULL}},
+    [e_tk_uncond] = {"uncond", {"res", NULL}},
+    [e_tk_cond] = {"cond", {"res", NULL}},
+    [e_tk_pipe] = {"pipe", {"res", NULL}},
+    [e_tk_fork] = {"fork", {"child", NULL}},
+    [e_tk_spawn] = {"spawn", {"child", NULL}},
+    [e_tk_exec] = {"exec", {NULL, NULL}},
+    [e_tk_wait] = {"wait", {"res", NULL}},
+    [e_tk_reap] = {"reap", {"child", "code"}}
+};
+
+typedef struct trace_event {
+    u64 ts_ns;
+    i32 pid;
+    i32 args[2];
+    u8 kind;
+    char phase; // 'B', 'E' or 'i'
+    u8 ready;   // stored last, a child can die halfway through
+    char name[c_trace_name_len];
+} trace_event_t;
+
+// Shared with every forked copy of the shell, slots are claimed atomically
+typedef struct trace_buffer {
+    u64 claimed;
+    trace_event_t events[];
+} trace_buffer_t;
+
+typedef struct tracer {
+    trace_buffer_t *buf; // NULL when not tracing
+    u64 map_sz;
+    pid_t pid;   // of the current process, kept across forks
+    pid_t owner; // the process that writes the file
+    char const *path;
+
+    // Begun and not yet ended by this process, innermost last
+    u8 open_kinds[c_trace_max_open];
+    u32 open_cnt;
+} tracer_t;
+
+static tracer_t g_trace = {0};
+
+static b32 trace_init(tracer_t *tracer, char const *path)
+{
+    tracer->map_sz = sizeof(trace_buffer_t) +
+        c_trace_max_events * sizeof(trace_event_t);
+    void *p = mmap(
+        NULL, tracer->map_sz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return false;
+
+    tracer->buf = (trace_buffer_t *)p;
+    tracer->pid = tracer->owner = getpid();
+    tracer->path = path;
+    return true;
+}
+
+static inline b32 tracing(void)
+{
+    return g_trace.buf != NULL;
+}
+
+static void trace_emit(
+    trace_kind_t kind, char phase, char const *name, u64 name_len,
+    i32 arg0, i32 arg1)
+{
+    if (!tracing())
+        return;
+    u64 const idx =
+        __atomic_fetch_add(&g_trace.buf->claimed, 1, __ATOMIC_RELAXED);
+    if (idx >= c_trace_max_events)
+        return;
+
+    trace_event_t *ev = &g_trace.buf->events[idx];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ev->ts_ns = (u64)now.tv_sec * 1000000000ull + (u64)now.tv_nsec;
+    ev->pid = g_trace.pid;
+    ev->args[0] = arg0;
+    ev->args[1] = arg1;
+    ev->kind = (u8)kind;
+    ev->phase = phase;
+    name_len = MIN(name_len, c_trace_name_len - 1);
+    mem_cpy(ev->name, name, name_len);
+    ev->name[name_len] = '\0';
+    __atomic_store_n(&ev->ready, 1, __ATOMIC_RELEASE);
+}
+
+static void trace_begin(trace_kind_t kind, char const *name, u64 name_len)
+{
+    if (!tracing())
+        return;
+    if (g_trace.open_cnt < c_trace_max_open)
+        g_trace.open_kinds[g_trace.open_cnt] = (u8)kind;
+    ++g_trace.open_cnt;
+    trace_emit(kind, 'B', name, name_len, 0, 0);
+}
+
+static void trace_end(trace_kind_t kind, int res)
+{
+    if (!tracing())
+        return;
+    if (g_trace.open_cnt > 0)
+        --g_trace.open_cnt;
+    trace_emit(kind, 'E', "", 0, res, 0);
+}
+
+// For a process that is replaced or exits from inside what it has begun
+static void trace_end_open(int res)
+{
+    while (g_trace.open_cnt > 0) {
+        u32 const i = g_trace.open_cnt - 1;
+        trace_end(
+            i < c_trace_max_open ? g_trace.open_kinds[i] : e_tk_uncond, res);
+    }
+}
+
+static void trace_instant(
+    trace_kind_t kind, char const *name, i32 arg0, i32 arg1)
+{
+    trace_emit(kind, 'i', name, cstr_len(name), arg0, arg1);
+}
+
+// AST nodes are named after their source, rendered only when tracing
+static void trace_begin_pipe(pipe_chain_node_t const *pp)
+{
+    if (!tracing())
+        return;
+    cmd_desc_t desc = {0};
+    describe_pipe_chain(&desc, pp);
+    trace_begin(e_tk_pipe, desc.buf, desc.len);
+}
+
+static void trace_begin_cond(cond_chain_node_t const *chain)
+{
+    if (!tracing())
+        return;
+    cmd_desc_t desc = {0};
+    describe_cond_chain(&desc, chain);
+    trace_begin(e_tk_cond, desc.buf, desc.len);
+}
+
+static void trace_begin_uncond(uncond_chain_node_t const *chain)
+{
+    if (!tracing())
+        return;
+    cmd_desc_t desc = {0};
+    describe_uncond_chain(&desc, chain);
+    trace_begin(e_tk_uncond, desc.buf, desc.len);
+}
+
+static void trace_write_json_str(FILE *f, char const *s)
+{
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", (unsigned char)*s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// Chrome trace-event JSON, loads in chrome://tracing and Perfetto
+static void trace_finish(tracer_t *tracer)
+{
+    if (!tracer->buf || tracer->pid != tracer->owner)
+        return;
+
+    FILE *f = fopen(tracer->path, "w");
+    if (!f)
+        perror(tracer->path);
+
+    u64 const claimed =
+        __atomic_load_n(&tracer->buf->claimed, __ATOMIC_ACQUIRE);
+    u64 const cnt = MIN(claimed, c_trace_max_events);
+    if (f) {
+        fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        b32 first = true;
+        for (u64 i = 0; i < cnt; ++i) {
+            trace_event_t const *ev = &tracer->buf->events[i];
+            if (!__atomic_load_n(&ev->ready, __ATOMIC_ACQUIRE))
+                continue;
+
+            fprintf(f, "%s{\"name\":", first ? "" : ",\n");
+            trace_write_json_str(f, ev->name);
+            fprintf(f,
+                ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                "\"pid\":%d,\"tid\":%d",
+                c_trace_kinds[ev->kind].cat, ev->phase,
+                (double)ev->ts_ns * 1e-3, ev->pid, ev->pid);
+            if (ev->phase == 'i')
+                fprintf(f, ",\"s\":\"p\"");
+
+            char const *const *names = c_trace_kinds[ev->kind].arg_names;
+            if (ev->phase != 'B' && names[0]) {
+                fprintf(f, ",\"args\":{\"%s\":%d", names[0], ev->args[0]);
+                if (names[1])
+                    fprintf(f, ",\"%s\":%d", names[1], ev->args[1]);
+                fprintf(f, "}");
+            }
+            fprintf(f, "}");
+            first = false;
+        }
+        fprintf(f, "\n]}\n");
+        fclose(f);
+    }
+    if (claimed > cnt) {
+        fprintf(stderr, "trace: dropped %lu events past the first %lu\n",
+            claimed - cnt, cnt);
+    }
+
+    munmap(tracer->buf, tracer->map_sz);
+    tracer->buf = NULL;
+}
+
+// Cost of a command: the shell's own usage over the run plus that of the
+// processes of the jobs it launched, as reported by wait4 with their reaped
+// descendants
+typedef struct run_cost {
+    struct timespec start;
+    struct rusage self_start;
+
+    struct timeval child_utime;
+    struct timeval child_stime;
+    long child_maxrss;
+    long child_nvcsw;
+    long child_nivcsw;
+    u32 child_cnt;
+
+    struct run_cost *outer;
+} run_cost_t;
+
+typedef struct run_cost_report {
+    double real;
+    double user;
+    double sys;
+    long maxrss; // KiB
+    long nvcsw;
+    long nivcsw;
+} run_cost_report_t;
+
+// Innermost command being measured
+static run_cost_t *g_run_cost = NULL;
+
+// Commands running at least this long get their cost printed, 0 is off
+static u64 g_slow_threshold_ms = 0;
+
+static double timeval_to_sec(struct timeval tv)
+{
+    return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
+}
+
+static void run_cost_begin(run_cost_t *cost)
+{
+    CLEAR(cost);
+    clock_gettime(CLOCK_MONOTONIC, &cost->start);
+    getrusage(RUSAGE_SELF, &cost->self_start);
+    cost->outer = g_run_cost;
+    g_run_cost = cost;
+}
+
+// A process counts towards every measurement enclosing its job's
+static void run_cost_add_proc(run_cost_t *inner, struct rusage const *ru)
+{
+    for (run_cost_t *cost = inner; cost; cost = cost->outer) {
+        timeradd(&cost->child_utime, &ru->ru_utime, &cost->child_utime);
+        timeradd(&cost->child_stime, &ru->ru_stime, &cost->child_stime);
+        if (ru->ru_maxrss > cost->child_maxrss)
+            cost->child_maxrss = ru->ru_maxrss;
+        cost->child_nvcsw += ru->ru_nvcsw;
+        cost->child_nivcsw += ru->ru_nivcsw;
+        ++cost->child_cnt;
+    }
+}
+
+static void run_cost_end(run_cost_t *cost, run_cost_report_t *out)
+{
+    struct timespec now;
+    struct rusage self;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &self);
+    g_run_cost = cost->outer;
+
+    // Jobs left running are counted by the outer one when they are done
+    for (job_t *job = g_jobs.first; job; job = job->next) {
+        if (job->cost == cost)
+            job->cost = cost->outer;
+    }
+
+    struct timeval self_utime, self_stime;
+    timersub(&self.ru_utime, &cost->self_start.ru_utime, &self_utime);
+    timersub(&self.ru_stime, &cost->self_start.ru_stime, &self_stime);
+
+    out->real = (double)(now.tv_sec - cost->start.tv_sec) +
+        (double)(now.tv_nsec - cost->start.tv_nsec) * 1e-9;
+    out->user =
+        timeval_to_sec(self_utime) + timeval_to_sec(cost->child_utime);
+    out->sys =
+        timeval_to_sec(self_stime) + timeval_to_sec(cost->child_stime);
+    // The shell's peak is only telling if nothing else ran
+    out->maxrss = cost->child_cnt ? cost->child_maxrss : self.ru_maxrss;
+    out->nvcsw = cost->child_nvcsw +
+        (self.ru_nvcsw - cost->self_start.ru_nvcsw);
+    out->nivcsw = cost->child_nivcsw +
+        (self.ru_nivcsw - cost->self_start.ru_nivcsw);
+}
+
+static void print_run_cost(run_cost_report_t const *rep)
+{
+    fprintf(stderr,
+        "\nreal\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n"
+        "maxrss\t%ld KiB\nctxsw\t%ld voluntary, %ld involuntary\n",
+        rep->real, rep->user, rep->sys,
+        rep->maxrss, rep->nvcsw, rep->nivcsw);
+}
+
+static void print_slow_run_cost(
+    run_cost_report_t const *rep, cmd_desc_t const *desc)
+{
+    fprintf(stderr,
+        "slow: %.3fs real, %.3fs user, %.3fs sys, %ld KiB, "
+        "%ld/%ld ctxsw: %s\n",
+        rep->real, rep->user, rep->sys,
+        rep->maxrss, rep->nvcsw, rep->nivcsw, desc->buf);
+}
+
+static job_t *job_table_add(
+    job_table_t *table, pid_t pgid, pid_t const *pids, u32 cnt)
+{
+    job_t *job = malloc(sizeof(job_t) + cnt * sizeof(job_proc_t));
+    if (!job)
+        return NULL;
+
+    job->id = 1;
+    job_t **link = &table->first;
+    for (; *link && (*link)->id == job->id; link = &(*link)->next)
+        ++job->id;
+    job->next = *link;
+    *link = job;
+
+    job->pgid = pgid;
+    job->state = e_js_running;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->desc.buf[0] = '\0';
+    job->desc.len = 0;
+    job->has_tmodes = false;
+    job->cost = g_run_cost;
+    job->proc_cnt = cnt;
+    for (u32 i = 0; i < cnt; ++i) {
+        job->procs[i].pid = pids[i];
+        job->procs[i].state = e_js_running;
+        job->procs[i].status = 0;
+        CLEAR(&job->procs[i].ru);
+    }
+    return job;
+}
+
+static void job_table_remove(job_table_t *table, job_t *job)
+{
+    for (u32 i = 0; job->cost && i < job->proc_cnt; ++i) {
+        if (job->procs[i].state == e_js_done)
+            run_cost_add_proc(job->cost, &job->procs[i].ru);
+    }
+
+    for (job_t **link = &table->first; *link; link = &(*link)->next) {
+        if (*link == job) {
+            *link = job->next;
+            break;
+        }
+    }
+    if (table->current == job->id)
+        table->current = 0;
+    free(job);
+}
+
+// A forked copy of the shell can't wait for its parent's jobs
+static void job_table_forget(job_table_t *table)
+{
+    while (table->first) {
+        table->first->cost = NULL;
+        job_table_remove(table, table->first);
+    }
+    g_job_control = false;
+}
+
+// The most recent job unless another one was stopped or resumed since
+static job_t *job_table_current(job_table_t *table)
+{
+    job_t *last = NULL;
+    for (job_t *job = table->first; job; job = job->next) {
+        if (job->id == table->current)
+            return job;
+        last = job;
+    }
+    return last;
+}
+
+static job_t *job_table_find_pid(
+    job_table_t *table, pid_t pid, job_proc_t **out_proc)
+{
+    for (job_t *job = table->first; job; job = job->next) {
+        for (u32 i = 0; i < job->proc_cnt; ++i) {
+            if (job->procs[i].pid == pid) {
+                *out_proc = &job->procs[i];
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void job_update_state(job_t *job)
+{
+    b32 any_running = false;
+    b32 any_stopped = false;
+    for (u32 i = 0; i < job->proc_cnt; ++i) {
+        any_running |= job->procs[i].state == e_js_running;
+        any_stopped |= job->procs[i].state == e_js_stopped;
+    }
+    job->state = any_running ? e_js_running :
+                 any_stopped ? e_js_stopped : e_js_done;
+}
+
+static void job_table_record(
+    job_table_t *table, pid_t pid, int status, struct rusage const *ru)
+{
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        trace_instant(e_tk_reap, "reap", pid,
+            WIFEXITED(status) ?
+            WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+
+    job_proc_t *proc;
+    job_t *job = job_table_find_pid(table, pid, &proc);
+    if (!job)
+        return;
+
+    if (WIFSTOPPED(status))
+        proc->state = e_js_stopped;
+    else if (WIFCONTINUED(status))
+        proc->state = e_js_running;
+    else {
+        proc->state = e_js_done;
+        proc->ru = *ru;
+    }
+    if (!WIFCONTINUED(status))
+        proc->status = status;
+    job_update_state(job);
+}
+
+// Collects every pending status change, false if there are no children.
+// Stops are only tracked with job control, a subshell just waits through.
+static b32 jobs_reap(void)
+{
+    int const flags =
+        WNOHANG | (g_job_control ? WUNTRACED | WCONTINUED : 0);
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, flags, &ru)) > 0)
+        job_table_record(&g_jobs, pid, status, &ru);
+    return pid == 0 || errno != ECHILD;
+}
+
+// True if a background job has finished since it was last reported
+static b32 reap_finished_jobs(void)
+{
+    jobs_reap();
+    for (job_t const *job = g_jobs.first; job; job = job->next) {
+        if (job->state == e_js_done)
+            return true;
+    }
+    return false;
+}
+
+enum {
+    c_kept_done_jobs = 64
+};
+
+static b32 timespec_before(struct timespec a, struct timespec b)
+{
+    return a.tv_sec < b.tv_sec ||
+        (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+// Without a terminal finished jobs are never reported, so only the latest
+// few are kept for a wait or jobs later in the script
+static void drop_old_finished_jobs(void)
+{
+    u32 done_cnt = 0;
+    for (job_t const *job = g_jobs.first; job; job = job->next)
+        done_cnt += job->state == e_js_done;
+
+    for (; done_cnt > c_kept_done_jobs; --done_cnt) {
+        job_t *oldest = NULL;
+        for (job_t *job = g_jobs.first; job; job = job->next) {
+            if (job->state == e_js_done &&
+                (!oldest || timespec_before(job->start, oldest->start)))
+            {
+                oldest = job;
+            }
+        }
+        job_table_remove(&g_jobs, oldest);
+    }
+}
+
+static int proc_exit_code(job_proc_t const *proc)
+{
+    if (proc->state == e_js_stopped)
+        return 128 + WSTOPSIG(proc->status);
+    return WIFEXITED(proc->status) ? WEXITSTATUS(proc->status) : -2;
+}
+
+// Status of the last stage, or of the stop if the job is suspended
+static int job_exit_code(job_t const *job)
+{
+    if (job->state == e_js_stopped) {
+        for (u32 i = 0; i < job->proc_cnt; ++i) {
+            if (job->procs[i].state == e_js_stopped)
+                return proc_exit_code(&job->procs[i]);
+        }
+    }
+    return proc_exit_code(&job->procs[job->proc_cnt - 1]);
+}
+
+// Blocks until one of the jobs is done or stopped, false if interrupted
+static b32 wait_for_any_job(
+    job_t *const *jobs, u32 cnt, b32 interruptible)
+{
+    for (;;) {
+        b32 const have_children = jobs_reap();
+        for (u32 i = 0; i < cnt; ++i) {
+            if (jobs[i]->state != e_js_running)
+                return true;
+        }
+
+        if (!have_children) {
+            // Nothing left to wait for, the statuses are lost
+            for (u32 i = 0; i < cnt; ++i) {
+                for (u32 j = 0; j < jobs[i]->proc_cnt; ++j)
+                    jobs[i]->procs[j].state = e_js_done;
+                jobs[i]->state = e_js_done;
+            }
+            return true;
+        }
+
+        // Forked copies of the shell set the loop up on first use
+        if (g_loop.epfd < 0 && !init_event_loop(&g_loop, -1, false)) {
+            int status;
+            struct rusage ru;
+            pid_t const pid = wait4(-1, &status, 0, &ru);
+            if (pid > 0)
+                job_table_record(&g_jobs, pid, status, &ru);
+            continue;
+        }
+
+        u32 const ev = event_loop_wait(&g_loop, false, -1);
+        if (interruptible && (ev & c_ev_interrupt))
+            return false;
+    }
+}
+
+static b32 wait_for_job(job_t *job, b32 interruptible)
+{
+    return wait_for_any_job(&job, 1, interruptible);
+}
+
+static void continue_job(job_t *job)
+{
+    for (u32 i = 0; i < job->proc_cnt; ++i) {
+        if (job->procs[i].state == e_js_stopped)
+            job->procs[i].state = e_js_running;
+    }
+    job_update_state(job);
+    if (job->pgid > 0)
+        kill(-job->pgid, SIGCONT);
+}
+
+static void announce_bg_job(job_t const *job)
+{
+    if (g_job_control)
+        fprintf(stderr, "[%u] %d\n", job->id, job->pgid);
+}
+
+// Waits for the job with the terminal handed over to it, a job that gets
+// suspended stays in the table
+static int run_job_in_fg(job_t *job, b32 resume)
+{
+    if (g_job_control && job->pgid > 0) {
+        if (resume && job->has_tmodes)
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+        set_term_fg(job->pgid);
+    }
+    if (resume)
+        continue_job(job);
+
+    trace_begin(e_tk_wait, job->desc.buf, job->desc.len);
+    wait_for_job(job, false);
+    trace_end(e_tk_wait, job_exit_code(job));
+
+    if (g_job_control) {
+        set_pgroup_as_term_fg();
+        if (job->state == e_js_stopped) {
+            job->has_tmodes = tcgetattr(STDIN_FILENO, &job->tmodes) == 0;
+            if (g_jobs.has_shell_tmodes) {
+                tcsetattr(
+                    STDIN_FILENO, TCSADRAIN, &g_jobs.shell_tmodes);
+            }
+        }
+    }
+
+    int const res = job_exit_code(job);
+    if (job->state == e_js_stopped) {
+        g_jobs.current = job->id;
+        fprintf(stderr, "\n[%u]+  Stopped                 %s\n",
+            job->id, job->desc.buf);
+    } else
+        job_table_remove(&g_jobs, job);
+    return res;
+}
+
+static void job_table_shutdown(job_table_t *table)
+{
+    for (job_t *job = table->first; job; job = job->next) {
+        if (job->state == e_js_stopped && job->pgid > 0) {
+            kill(-job->pgid, SIGHUP);
+            continue_job(job);
+        }
+    }
+    for (job_t *job = table->first; job; job = job->next)
+        wait_for_job(job, false);
+    while (table->first)
+        job_table_remove(table, table->first);
+}
+
+static char const *proc_state_str(
+    job_proc_t const *proc, char *buf, u32 buf_sz)
+{
+    if (proc->state == e_js_running)
+        return "Running";
+    else if (proc->state == e_js_stopped)
+        return "Stopped";
+    else if (WIFSIGNALED(proc->status))
+        return strsignal(WTERMSIG(proc->status));
+    else if (WEXITSTATUS(proc->status) == 0)
+        return "Done";
+
+    snprintf(buf, buf_sz, "Exit %d", WEXITSTATUS(proc->status));
+    return buf;
+}
+
+static void print_job(fd_writer_t *w, job_t const *job, b32 long_fmt)
+{
+    char buf[32];
+    char const *state =
+        job->state == e_js_running ? "Running" :
+        job->state == e_js_stopped ? "Stopped" :
+        proc_state_str(&job->procs[job->proc_cnt - 1], buf, sizeof(buf));
+
+    fdw_printf(w, "[%u]%c  %-22s  %s%s\n",
+        job->id, job->id == g_jobs.current ? '+' : ' ',
+        state, job->desc.buf, job->state == e_js_running ? " &" : "");
+    if (!long_fmt)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double const elapsed = (double)(now.tv_sec - job->start.tv_sec) +
+        (double)(now.tv_nsec - job->start.tv_nsec) * 1e-9;
+    fdw_printf(w, "      pgid %d, started %.1fs ago\n",
+        job->pgid, elapsed);
+    for (u32 i = 0; i < job->proc_cnt; ++i) {
+        job_proc_t const *proc = &job->procs[i];
+        fdw_printf(w, "      %-8d %s\n",
+            proc->pid, proc_state_str(proc, buf, sizeof(buf)));
+    }
+}
+
+// Reports finished background jobs before the prompt and forgets them
+static void notify_finished_jobs(void)
+{
+    jobs_reap();
+
+    fd_writer_t w;
+    fdw_init(&w, STDERR_FILENO);
+    for (job_t *job = g_jobs.first, *next; job; job = next) {
+        next = job->next;
+        if (job->state == e_js_done) {
+            print_job(&w, job, false);
+            job_table_remove(&g_jobs, job);
+        }
+    }
+    fdw_flush(&w);
+}
+
+// Everything a forked copy of the shell must not inherit
+static void reset_forked_shell(void)
+{
+    release_event_loop(&g_loop);
+    unblock_signals();
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    job_table_forget(&g_jobs);
+
+    // What the parent has begun it ends itself
+    pid_t const pid = getpid();
+    if (pid != g_trace.pid)
+        g_trace.open_cnt = 0;
+    g_trace.pid = pid;
+    g_run_cost = NULL;
+    g_slow_threshold_ms = 0;
+}
+
+// All builtins share this, io is where the pipe stage reads and writes
+typedef int (*builtin_fn_t)(int argc, char **argv, fd_pair_t io,
+                            arena_t *arena);
+
+typedef struct builtin_desc {
+    string_t name;
+    builtin_fn_t fn;
+    b32 (*applies)(command_node_t const *cmd); // NULL if it always does
+    b32 pure; // leaves the shell as it was, so $(...) can run it in-process
+    b32 tty_forks; // may block on a terminal, where ^Z can't stop the shell
+} builtin_desc_t;
+
+static int builtin_cd(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)io, (void)arena;
+    if (argc > 2) {
+        fprintf(stderr, "cd: too many arguments\n");
+        return 1;
+    }
+
+    char const *dir = NULL;
+    if (argc == 1 || strcmp(argv[1], "~") == 0) {
+        string_t const home_name = LITSTR("HOME");
+        string_t const home = var_get(&g_vars, home_name);
+        dir = string_is_valid(&home) ? home.p : getpwuid(getuid())->pw_dir;
+    } else
+        dir = argv[1];
+
+    if (chdir(dir) != 0) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Inter-stage pipe buffer size, 0 leaves the kernel default
+static u64 g_pipe_size = 0;
+
+// What an unprivileged process may set, read once
+static u64 pipe_max_size(void)
+{
+    static u64 max_size = 0;
+    if (max_size == 0) {
+        max_size = 1 << 20;
+        FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (f) {
+            unsigned long val;
+            if (fscanf(f, "%lu", &val) == 1 && val > 0)
+                max_size = val;
+            fclose(f);
+        }
+    }
+    return max_size;
+}
+
+static void set_pipe_size(int fd, u64 size)
+{
+    if (size > pipe_max_size())
+        size = pipe_max_size();
+    fcntl(fd, F_SETPIPE_SZ, (int)size);
+}
+
+// pipesize [N | default]: global setting for all pipes, the prefix form
+// is handled by the parser
+static int builtin_pipesize(int argc, char **argv, fd_pair_t io,
+                            arena_t *arena)
+{
+    (void)arena;
+    if (argc == 1) {
+        if (g_pipe_size == 0)
+            dprintf(io[1], "default\n");
+        else
+            dprintf(io[1], "%lu\n", MIN(g_pipe_size, pipe_max_size()));
+        return 0;
+    }
+
+    u64 size = 0;
+    if (strcmp(argv[1], "default") != 0 &&
+        (!parse_size(argv[1], &size) || size == 0))
+    {
+        fprintf(stderr, "pipesize: %s: invalid size\n", argv[1]);
+        return 2;
+    } else if (argc > 2) {
+        fprintf(stderr, "pipesize: the prefix form needs a command\n");
+        return 2;
+    }
+
+    g_pipe_size = size;
+    return 0;
+}
+
+static int builtin_time_threshold(int argc, char **argv, fd_pair_t io,
+                                  arena_t *arena)
+{
+    (void)arena;
+    if (argc == 1) {
+        if (g_slow_threshold_ms == 0)
+            dprintf(io[1], "off\n");
+        else
+            dprintf(io[1], "%lums\n", g_slow_threshold_ms);
+        return 0;
+    } else if (argc > 2) {
+        fprintf(stderr, "time-threshold: too many arguments\n");
+        return 2;
+    }
+
+    u64 ms = 0;
+    if (strcmp(argv[1], "off") != 0) {
+        char *end;
+        errno = 0;
+        ms = strtoull(argv[1], &end, 10);
+        if (errno || end == argv[1] || *end != '\0' || ms == 0) {
+            fprintf(stderr, "time-threshold: %s: invalid duration\n",
+                argv[1]);
+            return 2;
+        }
+    }
+
+    g_slow_threshold_ms = ms;
+    return 0;
+}
+
+// export [NAME[=value]...], lists the exported variables without args
+static int builtin_export(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)arena;
+    if (argc == 1) {
+        fd_writer_t w;
+        fdw_init(&w, io[1]);
+        for (u32 i = 0; i < g_vars.cap; ++i) {
+            var_t const *v = &g_vars.slots[i];
+            if (!string_is_valid(&v->name) || !v->exported)
+                continue;
+            fdw_printf(&w, "export %.*s", STR_PRINTF_ARGS(v->name));
+            if (string_is_valid(&v->value))
+                fdw_printf(&w, "=%s", v->value.p);
+            fdw_write(&w, "\n", 1);
+        }
+        return fdw_flush(&w) ? 0 : 1;
+    }
+
+    int res = 0;
+    for (int i = 1; i < argc; ++i) {
+        string_t const word = str_from_cstr(argv[i]);
+        u64 name_len = 0;
+        b32 const assigned = is_assignment(word, &name_len);
+        if (!assigned && (word.len == 0 || name_len != word.len)) {
+            fprintf(stderr, "export: %s: not a valid identifier\n", argv[i]);
+            res = 1;
+            continue;
+        }
+
+        string_t const name = {word.p, name_len};
+        var_export(&g_vars, name);
+        if (assigned) {
+            string_t const value = {
+                word.p + name_len + 1, word.len - name_len - 1};
+            var_set(&g_vars, name, value);
+        }
+    }
+    return res;
+}
+
+static int builtin_mem_stats(int argc, char **argv, fd_pair_t io,
+                             arena_t *arena)
+{
+    (void)argv, (void)arena;
+    if (argc > 1) {
+        fprintf(stderr, "mem-stats: too many arguments\n");
+        return 1;
+    }
+    print_arena_stats(io[1]);
+    return 0;
+}
+
+static int builtin_hash(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)arena;
+    cmd_hash_t *hash = &g_cmd_hash;
+
+    if (argc == 1) {
+        fd_writer_t w;
+        fdw_init(&w, io[1]);
+        if (hash->cnt == 0)
+            fdw_printf(&w, "hash: hash table empty\n");
+        else
+            fdw_printf(&w, "hits\tcommand\n");
+        for (u32 i = 0; i < hash->cap; ++i) {
+            cmd_hash_entry_t const *e = &hash->slots[i];
+            if (string_is_valid(&e->name))
+                fdw_printf(&w, "%4u\t%.*s\n",
+                    e->hits, STR_PRINTF_ARGS(e->path));
+        }
+        return fdw_flush(&w) ? 0 : 1;
+    }
+
+    int res = 0;
+    for (int i = 1; i < argc; ++i) {
+        string_t const name = str_from_cstr(argv[i]);
+        if (strcmp(argv[i], "-r") == 0) {
+            if (hash->enabled)
+                cmd_hash_reset(hash);
+        } else if (!cmd_hash_resolve(hash, name)) {
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            res = 1;
+        } else {
+            // Only added, not run
+            --cmd_hash_find_slot(hash->slots, hash->cap, name)->hits;
+        }
+    }
+    return res;
+}
+
+static int builtin_true(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)argc, (void)argv, (void)io, (void)arena;
+    return 0;
+}
+
+static int builtin_false(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)argc, (void)argv, (void)io, (void)arena;
+    return 1;
+}
+
+static int builtin_echo(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)arena;
+    fd_writer_t w;
+    fdw_init(&w, io[1]);
+
+    b32 newline = true;
+    int first = 1;
+    for (; first < argc && strcmp(argv[first], "-n") == 0; ++first)
+        newline = false;
+
+    for (int i = first; i < argc; ++i) {
+        if (i > first)
+            fdw_write(&w, " ", 1);
+        fdw_write(&w, argv[i], cstr_len(argv[i]));
+    }
+    if (newline)
+        fdw_write(&w, "\n", 1);
+
+    return fdw_flush(&w) ? 0 : 1;
+}
+
+static int builtin_pwd(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)argc, (void)argv, (void)arena;
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("pwd");
+        return 1;
+    }
+    return dprintf(io[1], "%s\n", cwd) < 0 ? 1 : 0;
+}
+
+// Unary test, -1 if op is not one
+static int test_unary(char const *op, char const *arg)
+{
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0')
+        return -1;
+
+    struct stat st;
+    switch (op[1]) {
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+    case 'e': return stat(arg, &st) == 0;
+    case 'f': return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+    case 'd': return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+    case 'b': return stat(arg, &st) == 0 && S_ISBLK(st.st_mode);
+    case 'c': return stat(arg, &st) == 0 && S_ISCHR(st.st_mode);
+    case 'p': return stat(arg, &st) == 0 && S_ISFIFO(st.st_mode);
+    case 'S': return stat(arg, &st) == 0 && S_ISSOCK(st.st_mode);
+    case 's': return stat(arg, &st) == 0 && st.st_size > 0;
+    case 'h':
+    case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 't': {
+        char *end;
+        long fd = strtol(arg, &end, 10);
+        return end != arg && *end == '\0' && isatty((int)fd);
+    }
+    }
+    return -1;
+}
+
+static b32 test_parse_int(char const *s, long long *out)
+{
+    char *end;
+    errno = 0;
+    *out = strtoll(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0') {
+        fprintf(stderr, "test: %s: integer expression expected\n", s);
+        return false;
+    }
+    return true;
+}
+
+// Binary test, -1 if op is not one, -2 on bad operands
+static int test_binary(char const *lhs, char const *op, char const *rhs)
+{
+    static char const *const int_ops[] = {
+        "-eq", "-ne", "-lt", "-le", "-gt", "-ge"
+    };
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        return strcmp(lhs, rhs) == 0;
+    else if (strcmp(op, "!=") == 0)
+        return strcmp(lhs, rhs) != 0;
+
+    for (u32 i = 0; i < sizeof(int_ops) / sizeof(*int_ops); ++i) {
+        if (strcmp(op, int_ops[i]) != 0)
+            continue;
+
+        long long l, r;
+        if (!test_parse_int(lhs, &l) || !test_parse_int(rhs, &r))
+            return -2;
+        switch (i) {
+        case 0: return l == r;
+        case 1: return l != r;
+        case 2: return l < r;
+        case 3: return l <= r;
+        case 4: return l > r;
+        default: return l >= r;
+        }
+    }
+    return -1;
+}
+
+static int test_negate(int res)
+{
+    return res == 2 ? 2 : !res;
+}
+
+typedef struct test_parser {
+    char **argv;
+    int argc;
+    int pos;
+    b32 failed;
+} test_parser_t;
+
+static b32 test_parse_or(test_parser_t *tp);
+
+// ! primary, ( expr ), unary, binary or a lone string
+static b32 test_parse_primary(test_parser_t *tp)
+{
+    if (tp->pos >= tp->argc) {
+        fprintf(stderr, "test: argument expected\n");
+        tp->failed = true;
+        return false;
+    }
+
+    char const *arg = tp->argv[tp->pos];
+    int const left = tp->argc - tp->pos;
+    if (strcmp(arg, "!") == 0) {
+        ++tp->pos;
+        return !test_parse_primary(tp);
+    } else if (strcmp(arg, "(") == 0) {
+        ++tp->pos;
+        b32 const res = test_parse_or(tp);
+        if (tp->pos >= tp->argc || strcmp(tp->argv[tp->pos], ")") != 0) {
+            if (!tp->failed)
+                fprintf(stderr, "test: ')' expected\n");
+            tp->failed = true;
+            return false;
+        }
+        ++tp->pos;
+        return res;
+    }
+
+    char **next = tp->argv + tp->pos + 1;
+    int r = left >= 3 ? test_binary(arg, next[0], next[1]) : -1;
+    if (r != -1) {
+        tp->pos += 3;
+        tp->failed |= r == -2;
+        return r == 1;
+    } else if (left >= 2 && (r = test_unary(arg, next[0])) >= 0) {
+        tp->pos += 2;
+        return r;
+    }
+    ++tp->pos;
+    return arg[0] != '\0';
+}
+
+// -a binds tighter than -o
+static b32 test_parse_and(test_parser_t *tp)
+{
+    b32 res = test_parse_primary(tp);
+    while (!tp->failed && tp->pos < tp->argc &&
+        strcmp(tp->argv[tp->pos], "-a") == 0)
+    {
+        ++tp->pos;
+        res = test_parse_primary(tp) && res;
+    }
+    return res;
+}
+
+static b32 test_parse_or(test_parser_t *tp)
+{
+    b32 res = test_parse_and(tp);
+    while (!tp->failed && tp->pos < tp->argc &&
+        strcmp(tp->argv[tp->pos], "-o") == 0)
+    {
+        ++tp->pos;
+        res = test_parse_and(tp) || res;
+    }
+    return res;
+}
+
+// POSIX rules by argument count, 0 is true, 1 false, 2 error. Longer
+// expressions and -a/-o go through the parser
+static int test_eval(int argc, char **argv)
+{
+    int r;
+    switch (argc) {
+    case 0:
+        return 1;
+    case 1:
+        return argv[0][0] != '\0' ? 0 : 1;
+    case 2:
+        if (strcmp(argv[0], "!") == 0)
+            return test_negate(test_eval(1, argv + 1));
+        if ((r = test_unary(argv[0], argv[1])) < 0) {
+            fprintf(stderr, "test: %s: unary operator expected\n", argv[0]);
+            return 2;
+        }
+        return !r;
+    case 3:
+        if ((r = test_binary(argv[0], argv[1], argv[2])) >= 0)
+            return !r;
+        else if (r == -2)
+            return 2;
+        else if (strcmp(argv[0], "!") == 0)
+            return test_negate(test_eval(2, argv + 1));
+        else if (strcmp(argv[0], "(") == 0 && strcmp(argv[2], ")") == 0)
+            return test_eval(1, argv + 1);
+        else if (strcmp(argv[1], "-a") != 0 && strcmp(argv[1], "-o") != 0) {
+            fprintf(stderr, "test: %s: binary operator expected\n", argv[1]);
+            return 2;
+        }
+        break;
+    case 4:
+        if (strcmp(argv[0], "!") == 0)
+            return test_negate(test_eval(3, argv + 1));
+        else if (strcmp(argv[0], "(") == 0 && strcmp(argv[3], ")") == 0)
+            return test_eval(2, argv + 1);
+        break;
+    }
+
+    test_parser_t tp = {argv, argc, 0, false};
+    b32 const res = test_parse_or(&tp);
+    if (tp.failed)
+        return 2;
+    else if (tp.pos < tp.argc) {
+        fprintf(stderr, "test: %s: unexpected argument\n", argv[tp.pos]);
+        return 2;
+    }
+    return !res;
+}
+
+static int builtin_test(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)io, (void)arena;
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        --argc;
+    }
+    return test_eval(argc - 1, argv + 1);
+}
+
+// *p points past the backslash, is moved to the last char of the escape
+static char unescape_char(char const **p)
+{
+    char const c = **p;
+    switch (c) {
+    case 'a': return '\a';
+    case 'b': return '\b';
+    case 'f': return '\f';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 't': return '\t';
+    case 'v': return '\v';
+    case '\\': return '\\';
+    }
+
+    if (c >= '0' && c <= '7') {
+        int val = 0;
+        for (int i = 0; i < 3 && **p >= '0' && **p <= '7'; ++i, ++*p)
+            val = val * 8 + (**p - '0');
+        --*p;
+        return (char)val;
+    }
+
+    // Not an escape, the backslash stays
+    --*p;
+    return '\\';
+}
+
+static int builtin_printf(int argc, char **argv, fd_pair_t io,
+                          arena_t *arena)
+{
+    (void)arena;
+    if (argc < 2) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    fd_writer_t w;
+    fdw_init(&w, io[1]);
+
+    char const *fmt = argv[1];
+    int argi = 2;
+    int res = 0;
+
+    // The format is reused while there are arguments left
+    int argi_before;
+    do {
+        argi_before = argi;
+        for (char const *p = fmt; *p; ++p) {
+            if (*p == '\\' && p[1] != '\0') {
+                ++p;
+                char const c = unescape_char(&p);
+                fdw_write(&w, &c, 1);
+                continue;
+            } else if (*p != '%') {
+                fdw_write(&w, p, 1);
+                continue;
+            } else if (p[1] == '%') {
+                fdw_write(&w, p++, 1);
+                continue;
+            }
+
+            u64 spec_len = 1 + strspn(p + 1, "-+ #0");
+            spec_len += strspn(p + spec_len, "0123456789");
+            if (p[spec_len] == '.') {
+                ++spec_len;
+                spec_len += strspn(p + spec_len, "0123456789");
+            }
+
+            char spec[32];
+            char const conv = p[spec_len];
+            if (spec_len > sizeof(spec) - 4 || !strchr("scdiuxXo", conv) ||
+                conv == '\0')
+            {
+                fprintf(stderr, "printf: %.*s: invalid format\n",
+                    (int)(spec_len + 1), p);
+                res = 1;
+                goto done;
+            }
+            mem_cpy(spec, p, spec_len);
+            p += spec_len;
+
+            char const *arg = argi < argc ? argv[argi++] : NULL;
+            if (conv == 's' || conv == 'c') {
+                spec[spec_len] = conv;
+                spec[spec_len + 1] = '\0';
+                if (conv == 's')
+                    fdw_printf(&w, spec, arg ? arg : "");
+                else
+                    fdw_printf(&w, spec, arg ? arg[0] : '\0');
+            } else {
+                spec[spec_len] = 'l';
+                spec[spec_len + 1] = 'l';
+                spec[spec_len + 2] = conv;
+                spec[spec_len + 3] = '\0';
+
+                long long val = 0;
+                if (arg) {
+                    char *end;
+                    errno = 0;
+                    val = conv == 'd' || conv == 'i' ?
+                        strtoll(arg, &end, 0) :
+                        (long long)strtoull(arg, &end, 0);
+                    if (errno != 0 || end == arg || *end != '\0') {
+                        fprintf(stderr,
+                            "printf: %s: invalid number\n", arg);
+                        res = 1;
+                    }
+                }
+                fdw_printf(&w, spec, val);
+            }
+        }
+    } while (argi < argc && argi > argi_before);
+
+done:
+    if (!fdw_flush(&w))
+        res = 1;
+    return res;
+}
+
+// %n, or %, %% and %+ for the current job
+static job_t *find_job_by_spec(char const *spec)
+{
+    if (!spec || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0 ||
+        strcmp(spec, "%+") == 0)
+    {
+        return job_table_current(&g_jobs);
+    } else if (spec[0] != '%')
+        return NULL;
+
+    char *end;
+    unsigned long const id = strtoul(spec + 1, &end, 10);
+    if (end == spec + 1 || *end != '\0')
+        return NULL;
+    for (job_t *job = g_jobs.first; job; job = job->next) {
+        if (job->id == id)
+            return job;
+    }
+    return NULL;
+}
+
+static int builtin_jobs(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)arena;
+    b32 long_fmt = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-l") != 0) {
+            fprintf(stderr, "jobs: %s: invalid option\n", argv[i]);
+            return 2;
+        }
+        long_fmt = true;
+    }
+
+    jobs_reap();
+
+    fd_writer_t w;
+    fdw_init(&w, io[1]);
+    for (job_t *job = g_jobs.first, *next; job; job = next) {
+        next = job->next;
+        print_job(&w, job, long_fmt);
+        if (job->state == e_js_done)
+            job_table_remove(&g_jobs, job);
+    }
+    return fdw_flush(&w) ? 0 : 1;
+}
+
+static int builtin_fg(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)arena;
+    if (!g_job_control) {
+        fprintf(stderr, "fg: no job control\n");
+        return 1;
+    } else if (argc > 2) {
+        fprintf(stderr, "fg: too many arguments\n");
+        return 1;
+    }
+
+    jobs_reap();
+
+    char const *spec = argc > 1 ? argv[1] : NULL;
+    job_t *job = find_job_by_spec(spec);
+    if (!job) {
+        fprintf(stderr, "fg: %s: no such job\n", spec ? spec : "current");
+        return 1;
+    } else if (job->state == e_js_done) {
+        fprintf(stderr, "fg: job %u has terminated\n", job->id);
+        job_table_remove(&g_jobs, job);
+        return 1;
+    }
+
+    dprintf(io[1], "%s\n", job->desc.buf);
+    return run_job_in_fg(job, true);
+}
+
+static int builtin_bg(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)arena;
+    if (!g_job_control) {
+        fprintf(stderr, "bg: no job control\n");
+        return 1;
+    }
+
+    jobs_reap();
+
+    int res = 0;
+    int i = 1;
+    do {
+        char const *spec = i < argc ? argv[i] : NULL;
+        job_t *job = find_job_by_spec(spec);
+        if (!job) {
+            fprintf(stderr,
+                "bg: %s: no such job\n", spec ? spec : "current");
+            res = 1;
+        } else if (job->state != e_js_stopped) {
+            fprintf(stderr, "bg: job %u already in background\n", job->id);
+        } else {
+            continue_job(job);
+            g_jobs.current = job->id;
+            dprintf(io[1], "[%u]+ %s &\n", job->id, job->desc.buf);
+        }
+    } while (++i < argc);
+    return res;
+}
+
+// Waits for all jobs, or for the given jobs or pids, and collects them
+static int builtin_wait(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    (void)io, (void)arena;
+
+    // Drop a stale ^C
+    event_loop_wait(&g_loop, false, 0);
+
+    if (argc == 1) {
+        for (job_t *job = g_jobs.first, *next; job; job = next) {
+            if (!wait_for_job(job, true))
+                return 128 + SIGINT;
+            next = job->next;
+            if (job->state == e_js_done)
+                job_table_remove(&g_jobs, job);
+        }
+        return 0;
+    }
+
+    int res = 0;
+    for (int i = 1; i < argc; ++i) {
+        job_proc_t *proc = NULL;
+        job_t *job = NULL;
+        if (argv[i][0] == '%')
+            job = find_job_by_spec(argv[i]);
+        else {
+            char *end;
+            long const pid = strtol(argv[i], &end, 10);
+            if (end != argv[i] && *end == '\0')
+                job = job_table_find_pid(&g_jobs, (pid_t)pid, &proc);
+        }
+
+        if (!job) {
+            fprintf(stderr, "wait: %s: no such job\n", argv[i]);
+            res = 127;
+            continue;
+        }
+
+        if (!wait_for_job(job, true))
+            return 128 + SIGINT;
+        res = proc ? proc_exit_code(proc) : job_exit_code(job);
+        if (job->state == e_js_done)
+            job_table_remove(&g_jobs, job);
+    }
+    return res;
+}
+
+static job_t *launch_pipe_job(
+    pipe_chain_node_t const *, char const **, fd_pair_t, b32, b32, b32 *,
+    arena_t *);
+static char const **resolve_exec_paths(pipe_chain_node_t const *, arena_t *);
+
+// Every {} in the word is replaced with the item
+static string_t substitute_item(char const *word, char const *item,
+                                b32 *substituted, arena_t *arena)
+{
+    u64 hits = 0;
+    for (char const *p = word; (p = strstr(p, "{}")); p += 2)
+        ++hits;
+    if (hits == 0)
+        return str_from_cstr((char *)word);
+
+    *substituted = true;
+    u64 const item_len = cstr_len(item);
+    string_t res = {0};
+    res.len = cstr_len(word) + hits * item_len - hits * 2;
+    res.p = ARENA_ALLOC_N(arena, char, res.len + 1);
+
+    char *out = res.p;
+    for (char const *p = word, *hit; *p; p = hit + 2) {
+        if (!(hit = strstr(p, "{}"))) {
+            strcpy(out, p);
+            break;
+        }
+        mem_cpy(out, p, hit - p);
+        out += hit - p;
+        mem_cpy(out, item, item_len);
+        out += item_len;
+    }
+    res.p[res.len] = '\0';
+    return res;
+}
+
+static command_node_t *instantiate_command(
+    char **tmpl, int tmpl_cnt, char const *item, arena_t *arena)
+{
+    command_node_t *cmd = ARENA_ALLOC(arena, command_node_t);
+    CLEAR(cmd);
+
+    b32 substituted = false;
+    arg_node_t *last_arg = NULL;
+    for (int i = 0; i <= tmpl_cnt; ++i) {
+        string_t word;
+        if (i < tmpl_cnt)
+            word = substitute_item(tmpl[i], item, &substituted, arena);
+        else if (!substituted)
+            word = str_from_cstr((char *)item);
+        else
+            break;
+
+        if (i == 0) {
+            cmd->cmd = word;
+            continue;
+        }
+
+        arg_node_t *arg = ARENA_ALLOC(arena, arg_node_t);
+        arg->name = word;
+        arg->next = NULL;
+        if (last_arg)
+            last_arg->next = arg;
+        else
+            cmd->args = arg;
+        last_arg = arg;
+        ++cmd->arg_cnt;
+    }
+
+    cmd->builtin = find_builtin(cmd);
+    return cmd;
+}
+
+static int dup_unless_std(int fd, int std_fd)
+{
+    return fd == std_fd ? fd : fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+// parallel [-j N] command [args...] [::: items...]
+// Runs the command once per item with at most N at a time, N defaults to
+// the online cpus. Items are lines of stdin unless listed. Exits with the
+// number of failed runs, 101 if more than 100 failed.
+static int builtin_parallel(int argc, char **argv, fd_pair_t io,
+                            arena_t *arena)
+{
+    long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+    int argi = 1;
+    if (argi < argc && strncmp(argv[argi], "-j", 2) == 0) {
+        char const *val = argv[argi][2] ? argv[argi] + 2 :
+                          argi + 1 < argc ? argv[++argi] : "";
+        char *end;
+        max_running = strtol(val, &end, 10);
+        if (end == val || *end != '\0' || max_running <= 0) {
+            fprintf(stderr, "parallel: %s: invalid job count\n", val);
+            return 2;
+        }
+        ++argi;
+    }
+    if (max_running <= 0)
+        max_running = 1;
+
+    int tmpl_end = argi;
+    while (tmpl_end < argc && strcmp(argv[tmpl_end], ":::") != 0)
+        ++tmpl_end;
+    if (tmpl_end == argi) {
+        fprintf(stderr,
+            "parallel: usage: parallel [-j N] command [args] [::: items]\n");
+        return 2;
+    }
+
+    b32 const items_listed = tmpl_end < argc;
+    int next_listed = tmpl_end + 1;
+    block_reader_t rd = {0};
+
+    // The children must not eat the item list
+    fd_pair_t child_io = {io[0], io[1]};
+    if (!items_listed) {
+        init_block_reader(&rd, io[0], arena);
+        if ((child_io[0] = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+            perror("parallel: /dev/null");
+            return 2;
+        }
+    }
+
+    // Drop a stale ^C
+    event_loop_wait(&g_loop, false, 0);
+
+    job_t **running = ARENA_ALLOC_N(arena, job_t *, max_running);
+    long running_cnt = 0;
+    u64 launched_cnt = 0;
+    u64 failed_cnt = 0;
+    b32 interrupted = false;
+    b32 items_left = true;
+
+    while (items_left || running_cnt > 0) {
+        while (items_left && !interrupted && running_cnt < max_running) {
+            // Nothing of an instance is needed after it has been launched
+            u64 const mark = arena->allocated;
+
+            char *item = NULL;
+            if (items_listed) {
+                if (next_listed < argc)
+                    item = argv[next_listed++];
+            } else {
+                string_t line = {0};
+                int rl;
+                do
+                    rl = read_line_from_block_reader(&rd, arena, &line);
+                while (rl == c_rl_ok && line.len == 0);
+                if (rl == c_rl_ok) {
+                    item = ARENA_ALLOC_N(arena, char, line.len + 1);
+                    mem_cpy(item, line.p, line.len);
+                    item[line.len] = '\0';
+                }
+            }
+            if (!item) {
+                items_left = false;
+                arena->allocated = mark;
+                break;
+            }
+
+            pipe_node_t elem = {0};
+            elem.runnable.type = e_rnt_cmd;
+            elem.runnable.cmd = instantiate_command(
+                argv + argi, tmpl_end - argi, item, arena);
+            pipe_chain_node_t pp = {0};
+            pp.chain = &elem;
+            pp.cmd_cnt = 1;
+
+            fd_pair_t launch_io = {
+                dup_unless_std(child_io[0], STDIN_FILENO),
+                dup_unless_std(child_io[1], STDOUT_FILENO)
+            };
+            b32 launch_failed = true;
+            job_t *job = NULL;
+            if (launch_io[0] >= 0 && launch_io[1] >= 0) {
+                job = launch_pipe_job(
+                    &pp, resolve_exec_paths(&pp, arena), launch_io,
+                    false, false, &launch_failed, arena);
+            } else
+                close_fd_pair(launch_io);
+
+            arena->allocated = mark;
+            ++launched_cnt;
+            if (job)
+                running[running_cnt++] = job;
+            else
+                ++failed_cnt;
+        }
+
+        if (running_cnt == 0)
+            break;
+
+        // ^C reaches the children too, then they are just collected
+        if (!wait_for_any_job(running, running_cnt, !interrupted))
+            interrupted = true;
+
+        for (long i = 0; i < running_cnt; ++i) {
+            job_t *job = running[i];
+            if (job->state == e_js_stopped) {
+                continue_job(job); // can't suspend the shell itself
+            } else if (job->state == e_js_done) {
+                if (job_exit_code(job) != 0)
+                    ++failed_cnt;
+                job_table_remove(&g_jobs, job);
+                running[i--] = running[--running_cnt];
+            }
+        }
+    }
+
+    if (!items_listed) {
+        close(child_io[0]);
+        release_block_reader(&rd);
+    }
+
+    if (interrupted)
+        return 128 + SIGINT;
+    if (failed_cnt > 0) {
+        fprintf(stderr, "parallel: %lu of %lu failed\n",
+            failed_cnt, launched_cnt);
+    }
+    return failed_cnt > 100 ? 101 : (int)failed_cnt;
+}
+
+enum {
+    c_relay_chunk_size = 1 << 20,
+    c_relay_buf_size = 64 << 10
+};
+
+typedef enum relay_mode {
+    e_rm_copy_range, // file to file, may share extents on cow filesystems
+    e_rm_splice,     // either end is a pipe
+    e_rm_sendfile,   // file to anything
+    e_rm_read_write
+} relay_mode_t;
+
+// An interactive ^C is only seen through the loop, so a relay that may
+// block has to watch it next to both ends until they are ready. A negative
+// fd is not waited for. False on ^C.
+static b32 relay_wait_ready(int in, int out)
+{
+    if (!g_job_control || g_loop.sigfd < 0)
+        return true;
+
+    struct pollfd pfds[3] = {
+        {in, POLLIN, 0}, {out, POLLOUT, 0}, {g_loop.sigfd, POLLIN, 0}};
+    while (pfds[0].fd >= 0 || pfds[1].fd >= 0) {
+        if (poll(pfds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return true;
+        }
+        if (pfds[2].revents &&
+            (event_loop_wait(&g_loop, false, 0) & c_ev_interrupt))
+        {
+            return false;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (pfds[i].revents)
+                pfds[i].fd = -1;
+        }
+    }
+    return true;
+}
+
+// Moves everything from in to out without going through userspace where
+// the kernel allows it. 0 on success, 1 on error, 128 + SIGINT on ^C.
+static int relay_fd(int in, int out, char const *name, arena_t *arena)
+{
+    struct stat in_st, out_st;
+    if (fstat(in, &in_st) != 0 || fstat(out, &out_st) != 0) {
+        fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+
+    b32 const in_reg = S_ISREG(in_st.st_mode);
+    b32 const out_reg = S_ISREG(out_st.st_mode);
+    if (in_reg && out_reg && in_st.st_dev == out_st.st_dev &&
+        in_st.st_ino == out_st.st_ino && in_st.st_size > 0)
+    {
+        fprintf(stderr, "cat: %s: input file is output file\n", name);
+        return 1;
+    }
+
+    // Files in /proc and /sys claim to be empty, the kernel paths copy
+    // exactly that
+    relay_mode_t mode =
+        in_reg && in_st.st_size == 0 ? e_rm_read_write :
+        in_reg && out_reg ? e_rm_copy_range :
+        S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode) ? e_rm_splice :
+        in_reg ? e_rm_sendfile : e_rm_read_write;
+    char *buf = NULL;
+
+    for (;;) {
+        if (!relay_wait_ready(in, out))
+            return 128 + SIGINT;
+
+        ssize_t moved;
+        switch (mode) {
+        case e_rm_copy_range:
+            moved = copy_file_range(in, NULL, out, NULL, c_relay_chunk_size, 0);
+            break;
+        case e_rm_splice:
+            moved = splice(
+                in, NULL, out, NULL, c_relay_chunk_size, SPLICE_F_MOVE);
+            break;
+        case e_rm_sendfile:
+            moved = sendfile(out, in, NULL, c_relay_chunk_size);
+            break;
+        default:
+            if (!buf)
+                buf = ARENA_ALLOC_N(arena, char, c_relay_buf_size);
+            moved = read(in, buf, c_relay_buf_size);
+            for (ssize_t done = 0, w; moved > 0 && done < moved; done += w) {
+                if (done > 0 && !relay_wait_ready(-1, out))
+                    return 128 + SIGINT;
+                if ((w = write(out, buf + done, moved - done)) < 0) {
+                    if (errno != EINTR) {
+                        moved = -1;
+                        break;
+                    }
+                    w = 0;
+                }
+            }
+        }
+
+        if (moved == 0)
+            return 0;
+        else if (moved > 0 || errno == EINTR || errno == EAGAIN)
+            continue;
+
+        // Not supported for this pair of fds, step down
+        if (mode != e_rm_read_write &&
+            (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+             errno == EOPNOTSUPP || errno == EBADF))
+        {
+            mode = mode != e_rm_sendfile && in_reg ?
+                e_rm_sendfile : e_rm_read_write;
+            continue;
+        }
+
+        fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+}
+
+// Options are left to the real cat
+static b32 cat_applies(command_node_t const *cmd)
+{
+    for (arg_node_t const *arg = cmd->args; arg; arg = arg->next) {
+        if (arg->name.len > 1 && arg->name.p[0] == '-')
+            return false;
+    }
+    return true;
+}
+
+static int builtin_cat(int argc, char **argv, fd_pair_t io, arena_t *arena)
+{
+    if (argc == 1)
+        return relay_fd(io[0], io[1], "-", arena);
+
+    int res = 0;
+    for (int i = 1; i < argc; ++i) {
+        b32 const is_stdin = strcmp(argv[i], "-") == 0;
+        int const fd = is_stdin ? io[0] : open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+            res = 1;
+            continue;
+        }
+
+        int const relay_res = relay_fd(fd, io[1], argv[i], arena);
+        if (!is_stdin)
+            close(fd);
+        if (relay_res == 128 + SIGINT)
+            return relay_res;
+        else if (relay_res != 0)
+            res = 1;
+    }
+    return res;
+}
+
+static builtin_desc_t const c_builtins[] = {
+    {.name = LITSTR("cd"), .fn = builtin_cd},
+    {.name = LITSTR("mem-stats"), .fn = builtin_mem_stats},
+    {.name = LITSTR("hash"), .fn = builtin_hash},
+    {.name = LITSTR("true"), .fn = builtin_true, .pure = true},
+    {.name = LITSTR("false"), .fn = builtin_false, .pure = true},
+    {.name = LITSTR("echo"), .fn = builtin_echo, .pure = true},
+    {.name = LITSTR("pwd"), .fn = builtin_pwd, .pure = true},
+    {.name = LITSTR("test"), .fn = builtin_test, .pure = true},
+    {.name = LITSTR("["), .fn = builtin_test, .pure = true},
+    {.name = LITSTR("printf"), .fn = builtin_printf, .pure = true},
+    {.name = LITSTR("jobs"), .fn = builtin_jobs},
+    {.name = LITSTR("fg"), .fn = builtin_fg},
+    {.name = LITSTR("bg"), .fn = builtin_bg},
+    {.name = LITSTR("wait"), .fn = builtin_wait},
+    {.name = LITSTR("parallel"), .fn = builtin_parallel},
+    {.name = LITSTR("cat"), .fn = builtin_cat,
+        .applies = cat_applies, .tty_forks = true},
+    {.name = LITSTR("pipesize"), .fn = builtin_pipesize},
+    {.name = LITSTR("time-threshold"), .fn = builtin_time_threshold},
+    {.name = LITSTR("export"), .fn = builtin_export},
+};
+
+static builtin_desc_t const *find_builtin(command_node_t const *cmd)
+{
+    for (u32 i = 0; i < sizeof(c_builtins) / sizeof(*c_builtins); ++i) {
+        builtin_desc_t const *b = &c_builtins[i];
+        if (str_eq(cmd->cmd, b->name))
+            return !b->applies || b->applies(cmd) ? b : NULL;
+    }
+    return NULL;
+}
+
+static int run_builtin(command_node_t const *cmd, fd_pair_t io,
+                       arena_t *arena)
+{
+    char **argv = build_argv(cmd, arena);
+    return cmd->builtin->fn((int)cmd->arg_cnt + 1, argv, io, arena);
+}
+
+
+static int execute_uncond_chain(
+    uncond_chain_node_t const *, b32, b32, arena_t *);
+
+// vfork-style launch (glibc uses CLONE_VM | CLONE_VFORK), so the cost does
+// not depend on how much memory the shell has mapped. Returns -1 if the
+// command has to go through the fork path (which also reports errors).
+// If pgid is not NULL the process joins *pgid (or starts it if it is 0),
+// take_term makes that the terminal foreground group.
+static pid_t spawn_command(
+    command_node_t const *cmd, char const *exec_path,
+    fd_pair_t *io_fd_pairs, int fd_pair_cnt,
+    int proc_id, pid_t const *pgid, b32 take_term, arena_t *arena)
+{
+    if (!exec_path) {
+        if (!str_has_chr(cmd->cmd, '/'))
+            return -1;
+        exec_path = cmd->cmd.p;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    if (posix_spawn_file_actions_init(&actions) != 0)
+        return -1;
+    if (posix_spawnattr_init(&attr) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    if (pgid) {
+        posix_spawnattr_setpgroup(&attr, *pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+        // Must happen in the child, or it can hit the terminal first
+        if (take_term)
+            posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+
+    if (io_fd_pairs[proc_id][0] != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(
+            &actions, io_fd_pairs[proc_id][0], STDIN_FILENO);
+    }
+    if (io_fd_pairs[proc_id][1] != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(
+            &actions, io_fd_pairs[proc_id][1], STDOUT_FILENO);
+    }
+    for (fd_pair_t *p = io_fd_pairs; p != io_fd_pairs + fd_pair_cnt; ++p) {
+        if ((*p)[0] != STDIN_FILENO)
+            posix_spawn_file_actions_addclose(&actions, (*p)[0]);
+        if ((*p)[1] != STDOUT_FILENO)
+            posix_spawn_file_actions_addclose(&actions, (*p)[1]);
+    }
+
+    sigset_t sigdef;
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGCHLD);
+    sigaddset(&sigdef, SIGINT);
+    sigaddset(&sigdef, SIGQUIT);
+    sigaddset(&sigdef, SIGTSTP);
+    sigaddset(&sigdef, SIGTTIN);
+    sigaddset(&sigdef, SIGTTOU);
+    sigaddset(&sigdef, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    sigset_t sigmask;
+    sigemptyset(&sigmask);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    flags |= POSIX_SPAWN_SETSIGMASK;
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    int const err = posix_spawn(
+        &pid, exec_path, &actions, &attr, build_argv(cmd, arena),
+        command_envp(cmd, arena));
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0)
+        return -1;
+    trace_instant(e_tk_spawn, exec_path, pid, 0);
+    return pid;
+}
+
+static void exec_command(command_node_t const *cmd, char const *exec_path,
+                         arena_t *arena)
+{
+    // Assignments in a child do nothing
+    if (!string_is_valid(&cmd->cmd))
+        _exit(0);
+
+    char **argv = build_argv(cmd, arena);
+    char **envp = command_envp(cmd, arena);
+    unblock_signals();
+    trace_instant(e_tk_exec, exec_path ? exec_path : argv[0], 0, 0);
+    trace_end_open(0);
+    if (exec_path)
+        execve(exec_path, argv, envp);
+    execvpe(argv[0], argv, envp);
+    perror(argv[0]);
+    _exit(1);
+}
+
+static pid_t execute_runnable(
+    runnable_node_t const *runnable, char const *exec_path,
+    fd_pair_t *io_fd_pairs, int fd_pair_cnt,
+    int proc_id, pid_t *pgid, b32 take_term, arena_t *arena)
+{
+    pid_t pid = -1;
+    if (!RUNNABLE_IS_EMPTY(runnable) && runnable->type == e_rnt_cmd &&
+        !runnable->cmd->builtin)
+    {
+        pid = spawn_command(
+            runnable->cmd, exec_path, io_fd_pairs, fd_pair_cnt,
+            proc_id, pgid, take_term, arena);
+    }
+
+    b32 const spawned = pid != -1;
+    if (pid == -1 && (pid = fork()) == 0) {
+        reset_forked_shell();
+
+        if (pgid) {
+            setpgid(0, *pgid);
+            if (take_term)
+                set_pgroup_as_term_fg();
+        }
+
+        if (io_fd_pairs[proc_id][0] != STDIN_FILENO)
+            dup2(io_fd_pairs[proc_id][0], STDIN_FILENO);
+        if (io_fd_pairs[proc_id][1] != STDOUT_FILENO)
+            dup2(io_fd_pairs[proc_id][1], STDOUT_FILENO);
+
+        close_fd_pairs(io_fd_pairs, fd_pair_cnt);
+
+        if (RUNNABLE_IS_EMPTY(runnable)) {
+            _exit(0);
+        } else if (runnable->type == e_rnt_cmd && runnable->cmd->builtin) {
+            fd_pair_t std_io = {STDIN_FILENO, STDOUT_FILENO};
+            _exit(run_builtin(runnable->cmd, std_io, arena));
+        } else if (runnable->type == e_rnt_cmd) {
+            exec_command(runnable->cmd, exec_path, arena);
+        } else {
+            _exit(execute_uncond_chain(
+                runnable->subshell, false, true, arena));
+        }
+    }
+
+    if (pid > 0 && !spawned)
+        trace_instant(e_tk_fork, "fork", pid, 0);
+
+    if (pid > 0 && pgid) {
+        // Both here and in the child, whoever is first
+        setpgid(pid, *pgid ? *pgid : pid);
+        if (*pgid == 0)
+            *pgid = pid;
+    }
+
+    close_fd_pair(io_fd_pairs[proc_id]);
+    return pid;
+}
+
+static b32 write_stdin_doc(int fd, stdin_doc_t const *doc)
+{
+    char const *p = doc->text.p;
+    u64 left = doc->text.len;
+    while (left > 0) {
+        ssize_t const written = write(fd, p, left);
+        if (written < 0 && errno == EINTR)
+            continue;
+        else if (written <= 0)
+            return false;
+        p += written;
+        left -= (u64)written;
+    }
+    return !doc->is_word || write(fd, "\n", 1) == 1;
+}
+
+// A doc that fits into a pipe is written there whole without blocking,
+// larger ones go into a memfd
+static int open_stdin_doc(stdin_doc_t const *doc)
+{
+    u64 const len = doc->text.len + doc->is_word;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == 0) {
+        int const cap = fcntl(fds[1], F_GETPIPE_SZ);
+        if (cap > 0 && len <= (u64)cap) {
+            b32 const ok = write_stdin_doc(fds[1], doc);
+            close(fds[1]);
+            if (ok)
+                return fds[0];
+            close(fds[0]);
+            return -1;
+        }
+        close_fd_pair(fds);
+    }
+
+    int const fd = memfd_create("stdin-doc", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (!write_stdin_doc(fd, doc) || lseek(fd, 0, SEEK_SET) != 0) {
+        perror("heredoc");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static b32 open_pipe_redirs(pipe_chain_node_t const *pp, fd_pair_t io)
+{
+    if (string_is_valid(&pp->stdin_redir))
+        io[0] = open(pp->stdin_redir.p, O_RDONLY);
+    else if (pp->stdin_doc)
+        io[0] = open_stdin_doc(pp->stdin_doc);
+    if (string_is_valid(&pp->stdout_redir)) {
+        io[1] = open(pp->stdout_redir.p, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else if (string_is_valid(&pp->stdout_append_redir)) {
+        io[1] = open(
+            pp->stdout_append_redir.p, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+    return io[0] >= 0 && io[1] >= 0;
+}
+
+// In a process that is going to exit right after the pipe anyway,
+// a single element can replace the process instead of being forked
+static void execute_pipe_in_place(
+    pipe_chain_node_t const *pp, char const *exec_path, arena_t *arena)
+{
+    ASSERT(pp->cmd_cnt == 1);
+
+    fd_pair_t io = {STDIN_FILENO, STDOUT_FILENO};
+    if (!open_pipe_redirs(pp, io)) {
+        trace_end_open(2);
+        _exit(2);
+    }
+    if (io[0] != STDIN_FILENO)
+        dup2(io[0], STDIN_FILENO);
+    if (io[1] != STDOUT_FILENO)
+        dup2(io[1], STDOUT_FILENO);
+    close_fd_pair(io);
+
+    runnable_node_t const *runnable = &pp->chain->runnable;
+    reset_forked_shell();
+    if (runnable->type == e_rnt_cmd)
+        exec_command(runnable->cmd, exec_path, arena); // does not return
+
+    int const res =
+        execute_uncond_chain(runnable->subshell, false, true, arena);
+    trace_end_open(res);
+    _exit(res);
+}
+
+// Starts the elements and registers them as a job. The outer ends of the
+// pipe are taken from io and closed. NULL if nothing could be started,
+// out_failed is set if some elements could not.
+static job_t *launch_pipe_job(
+    pipe_chain_node_t const *pp, char const **exec_paths, fd_pair_t io,
+    b32 own_group, b32 take_term, b32 *out_failed, arena_t *arena)
+{
+    ASSERT(!CHAIN_IS_EMPTY(pp));
+
+    int elem_cnt = pp->cmd_cnt;
+    pid_t *pids = ARENA_ALLOC_N(arena, pid_t, elem_cnt);
+    fd_pair_t *io_fd_pairs = ARENA_ALLOC_N(arena, fd_pair_t, elem_cnt);
+
+    for (int i = 0; i < elem_cnt; ++i) {
+        pids[i] = -1;
+        io_fd_pairs[i][0] = STDIN_FILENO;
+        io_fd_pairs[i][1] = STDOUT_FILENO;
+    }
+
+    io_fd_pairs[0][0] = io[0];
+    io_fd_pairs[elem_cnt - 1][1] = io[1];
+    *out_failed = true;
+
+    u64 const pipe_size = pp->pipe_size ? pp->pipe_size : g_pipe_size;
+
+    for (int i = 0; i < elem_cnt - 1; ++i) {
+        fd_pair_t fds = {0};
+        int res = pipe(fds);
+        if (res != 0) {
+            close_fd_pairs(io_fd_pairs, elem_cnt);
+            return NULL;
+        }
+
+        io_fd_pairs[i + 1][0] = fds[0];
+        io_fd_pairs[i][1] = fds[1];
+
+        if (pipe_size)
+            set_pipe_size(fds[1], pipe_size);
+    }
+
+    pid_t pgid = 0;
+    int launched_proc_cnt = 0;
+    b32 launch_failed = false;
+    for (pipe_node_t *elem = pp->chain; elem; elem = elem->next) {
+        int const this_proc_index = launched_proc_cnt;
         pid_t pid = execute_runnable(
-            &elem->runnable, io_fd_pairs, elem_cnt, this_proc_index, arena);
+            &elem->runnable, exec_paths[this_proc_index],
+            io_fd_pairs, elem_cnt, this_proc_index,
+            own_group ? &pgid : NULL, take_term, arena);
         if (pid == -1) {
             close_fd_pairs(io_fd_pairs, elem_cnt);
-            return -2;
+            launch_failed = true;
+            break;
+        }
+        
+        pids[launched_proc_cnt++] = pid;
+    }
+
+    job_t *job = NULL;
+    if (launched_proc_cnt > 0) {
+        job = job_table_add(&g_jobs, pgid, pids, launched_proc_cnt);
+        if (!job) {
+            for (int i = 0; i < launched_proc_cnt; ++i)
+                waitpid(pids[i], NULL, 0);
+        }
+    }
+    if (!job)
+        return NULL;
+
+    describe_pipe_chain(&job->desc, pp);
+    *out_failed = launch_failed;
+    return job;
+}
+
+// A background pipe is left running as a job, a foreground one is awaited
+static int execute_pipe_processes(
+    pipe_chain_node_t const *pp, char const **exec_paths,
+    b32 is_term, b32 bg, arena_t *arena)
+{
+    fd_pair_t redirs = {STDIN_FILENO, STDOUT_FILENO};
+    if (!open_pipe_redirs(pp, redirs)) {
+        close_fd_pair(redirs);
+        return -2;
+    }
+
+    // Job control: the elements get their own group, which gets the terminal
+    // if the job is in the foreground. Background jobs are always grouped.
+    b32 const take_term = is_term && !bg;
+    b32 launch_failed;
+    job_t *job = launch_pipe_job(
+        pp, exec_paths, redirs, is_term || bg, take_term, &launch_failed,
+        arena);
+    if (!job) {
+        if (take_term)
+            set_pgroup_as_term_fg();
+        return -2;
+    }
+
+    int res = 0;
+    if (bg) {
+        g_jobs.current = job->id;
+        announce_bg_job(job);
+    } else
+        res = run_job_in_fg(job, false);
+    return launch_failed ? -2 : res;
+}
+
+// Resolved here so that the cache outlives the children
+static char const **resolve_exec_paths(
+    pipe_chain_node_t const *pp, arena_t *arena)
+{
+    char const **exec_paths = ARENA_ALLOC_N(arena, char const *, pp->cmd_cnt);
+    int i = 0;
+    for (pipe_node_t *elem = pp->chain; elem; elem = elem->next, ++i) {
+        runnable_node_t const *r = &elem->runnable;
+        exec_paths[i] =
+            !RUNNABLE_IS_EMPTY(r) && r->type == e_rnt_cmd &&
+            !r->cmd->builtin && string_is_valid(&r->cmd->cmd) ?
+            cmd_hash_resolve(&g_cmd_hash, r->cmd->cmd) : NULL;
+    }
+    return exec_paths;
+}
+
+enum {
+    c_capture_chunk = 64 << 10
+};
+
+static int execute_uncond_chain(
+    uncond_chain_node_t const *, b32, b32, arena_t *);
+
+// Reads to EOF straight into one block at the top of the arena. Trailing
+// newlines are dropped, the result is NUL-terminated.
+static string_t read_fd_into_arena(int fd, arena_t *arena)
+{
+    string_t res = {ARENA_ALLOC_N(arena, char, 0), 0};
+    for (;;) {
+        char *chunk = ARENA_ALLOC_N(arena, char, c_capture_chunk);
+        ssize_t const n = read(fd, chunk, c_capture_chunk);
+        if (n < 0 && errno == EINTR) {
+            arena->allocated -= c_capture_chunk;
+            continue;
+        }
+
+        // What the read did not fill goes back, the next chunk continues it
+        u64 const got = n > 0 ? (u64)n : 0;
+        arena->allocated -= c_capture_chunk - got;
+        if (got == 0)
+            break;
+        res.len += got;
+    }
+
+    (void)ARENA_ALLOC(arena, char);
+    while (res.len > 0 && res.p[res.len - 1] == '\n')
+        --res.len;
+    res.p[res.len] = '\0';
+    return res;
+}
+
+// A builtin that $(...) can run without forking a subshell
+static command_node_t *get_lone_builtin(root_node_t const *root)
+{
+    if (root->uncond_cnt != 1)
+        return NULL;
+    uncond_node_t const *u = root->chain;
+    if (u->link == e_ul_bg || u->cond.cond_cnt != 1 || u->cond.timed)
+        return NULL;
+    pipe_chain_node_t const *pp = &u->cond.chain->pp;
+    if (pp->cmd_cnt != 1)
+        return NULL;
+    runnable_node_t const *r = &pp->chain->runnable;
+    if (r->type != e_rnt_cmd || !r->cmd->builtin || !r->cmd->builtin->pure ||
+        string_is_valid(&pp->stdin_redir) || pp->stdin_doc ||
+        string_is_valid(&pp->stdout_redir) ||
+        string_is_valid(&pp->stdout_append_redir))
+    {
+        return NULL;
+    }
+    return r->cmd;
+}
+
+// Output of the command line src, invalid if it could not be run
+static string_t capture_output(string_t src, arena_t *arena)
+{
+    string_t res = {0};
+    root_node_t const *parsed = parse_line(src, NULL, arena);
+    if (!parsed)
+        return res;
+    root_node_t const *root = compile_plan(parsed, arena);
+    if (CHAIN_IS_EMPTY(root)) {
+        res.p = ARENA_ALLOC_N(arena, char, 1);
+        res.p[0] = '\0';
+        return res;
+    }
+
+    command_node_t const *builtin = get_lone_builtin(root);
+    if (builtin) {
+        int const fd = memfd_create("subst", MFD_CLOEXEC);
+        if (fd < 0) {
+            perror("memfd_create");
+            return res;
+        }
+        fd_pair_t io = {STDIN_FILENO, fd};
+        run_builtin(builtin, io, arena);
+        lseek(fd, 0, SEEK_SET);
+        res = read_fd_into_arena(fd, arena);
+        close(fd);
+        return res;
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        perror("pipe");
+        return res;
+    }
+    pid_t const pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close_fd_pair(fds);
+        return res;
+    }
+    if (pid == 0) {
+        reset_forked_shell();
+        dup2(fds[1], STDOUT_FILENO);
+        close_fd_pair(fds);
+        _exit(execute_uncond_chain(root, false, true, arena));
+    }
+
+    close(fds[1]);
+    trace_instant(e_tk_fork, "fork", pid, 0);
+    job_t *job = job_table_add(&g_jobs, 0, &pid, 1);
+    res = read_fd_into_arena(fds[0], arena);
+    close(fds[0]);
+
+    if (job) {
+        wait_for_job(job, false);
+        job_table_remove(&g_jobs, job);
+    } else
+        waitpid(pid, NULL, 0);
+    return res;
+}
+
+typedef struct word_list {
+    arg_node_t *first;
+    arg_node_t *last;
+    u64 cnt;
+} word_list_t;
+
+static void word_list_push(word_list_t *list, string_t word, arena_t *arena)
+{
+    arg_node_t *node = ARENA_ALLOC(arena, arg_node_t);
+    node->name = word;
+    node->expand = false;
+    node->next = NULL;
+    if (list->last)
+        list->last->next = node;
+    else
+        list->first = node;
+    list->last = node;
+    ++list->cnt;
+}
+
+static int cmp_word_nodes(void const *a, void const *b)
+{
+    arg_node_t const *const *na = a;
+    arg_node_t const *const *nb = b;
+    return strcmp((*na)->name.p, (*nb)->name.p);
+}
+
+static void sort_word_list(word_list_t *list, arena_t *arena)
+{
+    if (list->cnt < 2)
+        return;
+    arg_node_t **nodes = ARENA_ALLOC_N(arena, arg_node_t *, list->cnt);
+    u64 i = 0;
+    for (arg_node_t *n = list->first; n; n = n->next)
+        nodes[i++] = n;
+    qsort(nodes, list->cnt, sizeof(*nodes), cmp_word_nodes);
+    for (i = 0; i + 1 < list->cnt; ++i)
+        nodes[i]->next = nodes[i + 1];
+    nodes[list->cnt - 1]->next = NULL;
+    list->first = nodes[0];
+    list->last = nodes[list->cnt - 1];
+}
+
+static void word_list_append(word_list_t *list, word_list_t *tail)
+{
+    if (!tail->first)
+        return;
+    if (list->last)
+        list->last->next = tail->first;
+    else
+        list->first = tail->first;
+    list->last = tail->last;
+    list->cnt += tail->cnt;
+}
+
+enum {
+    c_getdents_buf_size = 64 * 1024,
+    c_dir_cache_mem_size = 256 * 1024 * 1024,
+    c_tree_walker_mem_size = 256 * 1024 * 1024,
+    c_max_tree_walkers = 8,
+    c_dir_cache_initial_cap = 64
+};
+
+typedef struct dir_entry {
+    char const *name;
+    u8 type; // DT_*, DT_UNKNOWN is resolved on read
+} dir_entry_t;
+
+typedef struct dir_listing {
+    string_t path; // "" for the cwd, otherwise ends with '/'
+    dir_entry_t *entries; // sorted by name
+    u32 cnt;
+    b32 tree_walked; // so is every dir below that is not hidden
+    struct dir_listing *next; // in the results of a tree walker
+} dir_listing_t;
+
+// Directory listings read for globs. They are shared by the globs of one
+// pipe and dropped before the next, which may see a changed tree.
+// A ** walk reads its tree with several threads, each into its own arena.
+typedef struct dir_cache {
+    arena_t arena;
+    arena_t walker_arenas[c_max_tree_walkers];
+    u32 walker_arena_cnt; // reserved on first use
+    b32 enabled;
+
+    dir_listing_t **slots; // allocated on first use in a line
+    u32 cap;               // power of 2
+    u32 cnt;
+} dir_cache_t;
+
+static dir_cache_t g_dir_cache = {0};
+
+static int cmp_dir_entries(void const *a, void const *b)
+{
+    return strcmp(
+        ((dir_entry_t const *)a)->name, ((dir_entry_t const *)b)->name);
+}
+
+static u8 stat_dir_entry_type(int dir_fd, char const *name)
+{
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return DT_REG;
+    return S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+}
+
+// Batches of getdents64 instead of a readdir call per entry. The names
+// are packed as type, name, '\0' right after each other in the arena,
+// then indexed. A dir that can't be read comes out empty.
+static dir_listing_t *read_dir_listing(string_t path, arena_t *arena)
+{
+    dir_listing_t *listing = ARENA_ALLOC(arena, dir_listing_t);
+    CLEAR(listing);
+    listing->path = path;
+
+    int const fd = open(
+        path.len ? path.p : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return listing;
+
+    alignas(8) char buf[c_getdents_buf_size];
+    char *records = ARENA_ALLOC_N(arena, char, 0);
+    u32 cnt = 0;
+    ssize_t n;
+    while ((n = getdents64(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 const *d = (struct dirent64 const *)(buf + off);
+            off += d->d_reclen;
+
+            char const *name = d->d_name;
+            if (name[0] == '.' &&
+                (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            {
+                continue;
+            }
+
+            u64 const len = cstr_len(name);
+            char *rec = ARENA_ALLOC_N(arena, char, len + 2);
+            rec[0] = d->d_type == DT_UNKNOWN ?
+                stat_dir_entry_type(fd, name) : d->d_type;
+            mem_cpy(rec + 1, name, len + 1);
+            ++cnt;
+        }
+    }
+    close(fd);
+
+    listing->entries = ARENA_ALLOC_N(arena, dir_entry_t, cnt);
+    char const *rec = records;
+    for (u32 i = 0; i < cnt; ++i) {
+        listing->entries[i].type = (u8)rec[0];
+        listing->entries[i].name = rec + 1;
+        rec += cstr_len(rec + 1) + 2;
+    }
+    qsort(listing->entries, cnt, sizeof(dir_entry_t), cmp_dir_entries);
+    listing->cnt = cnt;
+    return listing;
+}
+
+static b32 dir_cache_ensure(dir_cache_t *cache)
+{
+    if (!cache->enabled) {
+        cache->enabled =
+            arena_init(&cache->arena, "dir-cache", c_dir_cache_mem_size);
+    }
+    if (cache->enabled && !cache->slots) {
+        cache->cap = c_dir_cache_initial_cap;
+        cache->cnt = 0;
+        cache->slots =
+            ARENA_ALLOC_N(&cache->arena, dir_listing_t *, cache->cap);
+        mem_clear(cache->slots, cache->cap * sizeof(*cache->slots));
+    }
+    return cache->enabled;
+}
+
+static void dir_cache_reset(dir_cache_t *cache)
+{
+    if (!cache->enabled)
+        return;
+    arena_drop(&cache->arena);
+    for (u32 i = 0; i < cache->walker_arena_cnt; ++i)
+        arena_drop(&cache->walker_arenas[i]);
+    cache->slots = NULL;
+    cache->cnt = 0;
+}
+
+static void release_dir_cache(dir_cache_t *cache)
+{
+    if (!cache->enabled)
+        return;
+    arena_release(&cache->arena);
+    for (u32 i = 0; i < cache->walker_arena_cnt; ++i)
+        arena_release(&cache->walker_arenas[i]);
+    cache->walker_arena_cnt = 0;
+    cache->enabled = false;
+}
+
+static dir_listing_t **dir_cache_find_slot(
+    dir_listing_t **slots, u32 cap, string_t path)
+{
+    u32 const mask = cap - 1;
+    for (u32 i = (u32)str_hash(path) & mask;; i = (i + 1) & mask) {
+        if (!slots[i] || str_eq(slots[i]->path, path))
+            return &slots[i];
+    }
+}
+
+static void dir_cache_insert(dir_cache_t *cache, dir_listing_t *listing)
+{
+    if ((cache->cnt + 1) * 2 > cache->cap) {
+        u32 const new_cap = cache->cap * 2;
+        dir_listing_t **new_slots =
+            ARENA_ALLOC_N(&cache->arena, dir_listing_t *, new_cap);
+        mem_clear(new_slots, new_cap * sizeof(*new_slots));
+        for (u32 i = 0; i < cache->cap; ++i) {
+            if (cache->slots[i]) {
+                *dir_cache_find_slot(
+                    new_slots, new_cap, cache->slots[i]->path) =
+                    cache->slots[i];
+            }
+        }
+        cache->slots = new_slots;
+        cache->cap = new_cap;
+    }
+
+    dir_listing_t **slot =
+        dir_cache_find_slot(cache->slots, cache->cap, listing->path);
+    cache->cnt += !*slot;
+    *slot = listing;
+}
+
+static dir_listing_t *dir_cache_get(dir_cache_t *cache, string_t path)
+{
+    dir_listing_t *listing =
+        *dir_cache_find_slot(cache->slots, cache->cap, path);
+    if (!listing) {
+        listing = read_dir_listing(path, &cache->arena);
+        dir_cache_insert(cache, listing);
+    }
+    return listing;
+}
+
+// dir + name, with a '/' after if the result is a dir to be read
+static string_t path_join(
+    string_t dir, char const *name, u64 name_len, b32 slash, arena_t *arena)
+{
+    string_t res = {0};
+    res.len = dir.len + name_len + slash;
+    res.p = ARENA_ALLOC_N(arena, char, res.len + 1);
+    mem_cpy(res.p, dir.p, dir.len);
+    mem_cpy(res.p + dir.len, name, name_len);
+    if (slash)
+        res.p[res.len - 1] = '/';
+    res.p[res.len] = '\0';
+    return res;
+}
+
+// Shared by the threads of one ** walk
+typedef struct tree_walk {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    string_t *pending; // dirs not read yet, malloc'd
+    u32 pending_cnt;
+    u32 pending_cap;
+    u32 busy; // walkers reading a dir, they may add more
+} tree_walk_t;
+
+typedef struct tree_walker {
+    tree_walk_t *walk;
+    arena_t *arena;
+    dir_listing_t *done;
+    pthread_t thread;
+} tree_walker_t;
+
+static void tree_walk_add(tree_walk_t *walk, string_t const *dirs, u32 cnt)
+{
+    if (walk->pending_cnt + cnt > walk->pending_cap) {
+        u32 const new_cap = MAX(2 * walk->pending_cap, walk->pending_cnt + cnt);
+        string_t *p = realloc(walk->pending, new_cap * sizeof(string_t));
+        if (!p)
+            return; // those subtrees are just not matched
+        walk->pending = p;
+        walk->pending_cap = new_cap;
+    }
+    mem_cpy(walk->pending + walk->pending_cnt, dirs, cnt * sizeof(string_t));
+    walk->pending_cnt += cnt;
+}
+
+static void *tree_walker_main(void *arg)
+{
+    tree_walker_t *w = arg;
+    tree_walk_t *walk = w->walk;
+
+    pthread_mutex_lock(&walk->lock);
+    for (;;) {
+        while (walk->pending_cnt == 0 && walk->busy > 0)
+            pthread_cond_wait(&walk->cond, &walk->lock);
+        if (walk->pending_cnt == 0)
+            break; // and no one left to add any
+
+        string_t const dir = walk->pending[--walk->pending_cnt];
+        ++walk->busy;
+        pthread_mutex_unlock(&walk->lock);
+
+        dir_listing_t *listing = read_dir_listing(dir, w->arena);
+        listing->tree_walked = true;
+        listing->next = w->done;
+        w->done = listing;
+
+        string_t *subdirs = ARENA_ALLOC_N(w->arena, string_t, listing->cnt);
+        u32 subdir_cnt = 0;
+        for (u32 i = 0; i < listing->cnt; ++i) {
+            dir_entry_t const *e = &listing->entries[i];
+            if (e->type == DT_DIR && e->name[0] != '.') {
+                subdirs[subdir_cnt++] =
+                    path_join(dir, e->name, cstr_len(e->name), true, w->arena);
+            }
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        tree_walk_add(walk, subdirs, subdir_cnt);
+        --walk->busy;
+        if (subdir_cnt > 0 || walk->busy == 0)
+            pthread_cond_broadcast(&walk->cond);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+static void collect_cached_tree(
+    dir_cache_t *cache, dir_listing_t const *listing, word_list_t *out,
+    arena_t *arena)
+{
+    word_list_push(out, listing->path, arena);
+    for (u32 i = 0; i < listing->cnt; ++i) {
+        dir_entry_t const *e = &listing->entries[i];
+        if (e->type != DT_DIR || e->name[0] == '.')
+            continue;
+        string_t const sub =
+            path_join(listing->path, e->name, cstr_len(e->name), true, arena);
+        collect_cached_tree(cache, dir_cache_get(cache, sub), out, arena);
+    }
+}
+
+// root and every dir below it that is not hidden, symlinks are not followed
+static void walk_tree(
+    dir_cache_t *cache, string_t root, word_list_t *out, arena_t *arena)
+{
+    dir_listing_t const *cached =
+        *dir_cache_find_slot(cache->slots, cache->cap, root);
+    if (cached && cached->tree_walked) {
+        collect_cached_tree(cache, cached, out, arena);
+        return;
+    }
+
+    long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 const want = (u32)MIN(MAX(cpus, 1), c_max_tree_walkers);
+    while (cache->walker_arena_cnt < want &&
+           arena_init(&cache->walker_arenas[cache->walker_arena_cnt],
+                      "tree-walker", c_tree_walker_mem_size))
+    {
+        ++cache->walker_arena_cnt;
+    }
+
+    tree_walk_t walk = {0};
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+    tree_walk_add(&walk, &root, 1);
+
+    // The first one runs right here, also if no arena could be reserved
+    tree_walker_t walkers[c_max_tree_walkers] = {0};
+    u32 const walker_cnt = MAX(cache->walker_arena_cnt, 1);
+    u32 started = 1;
+    for (u32 i = 0; i < walker_cnt; ++i) {
+        walkers[i].walk = &walk;
+        walkers[i].arena = cache->walker_arena_cnt ?
+            &cache->walker_arenas[i] : &cache->arena;
+    }
+    for (u32 i = 1; i < walker_cnt; ++i) {
+        if (pthread_create(
+                &walkers[i].thread, NULL, tree_walker_main, &walkers[i]) != 0)
+        {
+            break;
         }
-        
-        pids[this_proc_index] = pid;
+        ++started;
+    }
+    tree_walker_main(&walkers[0]);
+    for (u32 i = 1; i < started; ++i)
+        pthread_join(walkers[i].thread, NULL);
+
+    free(walk.pending);
+    pthread_cond_destroy(&walk.cond);
+    pthread_mutex_destroy(&walk.lock);
+
+    for (u32 i = 0; i < started; ++i) {
+        for (dir_listing_t *l = walkers[i].done; l; l = l->next) {
+            dir_cache_insert(cache, l);
+            word_list_push(out, l->path, arena);
+        }
+    }
+    sort_word_list(out, arena);
+}
+
+static void unescape_in_place(string_t *s)
+{
+    u64 out = 0;
+    for (u64 i = 0; i < s->len; ++i) {
+        if (s->p[i] == '\\' && i + 1 < s->len)
+            ++i;
+        s->p[out++] = s->p[i];
     }
+    s->len = out;
+    s->p[out] = '\0';
+}
 
-    return await_processes(pids, launched_proc_cnt);
+static b32 is_dir_entry(
+    dir_listing_t const *listing, dir_entry_t const *e, arena_t *arena)
+{
+    if (e->type == DT_DIR)
+        return true;
+    else if (e->type != DT_LNK)
+        return false;
+
+    // Symlinks are followed except by **
+    struct stat st;
+    string_t const path =
+        path_join(listing->path, e->name, cstr_len(e->name), false, arena);
+    return stat(path.p, &st) == 0 && S_ISDIR(st.st_mode);
 }
 
-static int execute_pipe_chain(
-    pipe_chain_node_t const *pp, b32 is_term, arena_t *arena)
+typedef struct glob_pattern {
+    string_t *comps; // split at '/', still escaped
+    u32 comp_cnt;
+} glob_pattern_t;
+
+static void glob_match_from(
+    dir_cache_t *cache, glob_pattern_t const *pat, u32 comp_idx,
+    string_t dir, word_list_t *out, arena_t *arena)
 {
-    if (CHAIN_IS_EMPTY(pp))
+    if (comp_idx == pat->comp_cnt) {
+        if (dir.len > 0)
+            word_list_push(out, dir, arena);
+        return;
+    }
+
+    string_t comp = pat->comps[comp_idx];
+    b32 const last = comp_idx + 1 == pat->comp_cnt;
+
+    if (comp.len == 2 && comp.p[0] == '*' && comp.p[1] == '*') {
+        word_list_t dirs = {0};
+        walk_tree(cache, dir, &dirs, arena);
+        for (arg_node_t const *d = dirs.first; d; d = d->next)
+            glob_match_from(cache, pat, comp_idx + 1, d->name, out, arena);
+    } else if (!has_glob(comp)) {
+        string_t name = path_join(comp, "", 0, false, arena);
+        unescape_in_place(&name);
+        string_t const path = path_join(dir, name.p, name.len, !last, arena);
+        struct stat st;
+        if (!last)
+            glob_match_from(cache, pat, comp_idx + 1, path, out, arena);
+        else if (name.len == 0 || lstat(path.p, &st) == 0)
+            word_list_push(out, path, arena);
+    } else {
+        // fnmatch wants it terminated
+        comp = path_join(comp, "", 0, false, arena);
+        dir_listing_t const *listing = dir_cache_get(cache, dir);
+        for (u32 i = 0; i < listing->cnt; ++i) {
+            dir_entry_t const *e = &listing->entries[i];
+            if (fnmatch(comp.p, e->name, FNM_PERIOD) != 0)
+                continue;
+            if (last) {
+                word_list_push(out,
+                    path_join(dir, e->name, cstr_len(e->name), false, arena),
+                    arena);
+            } else if (is_dir_entry(listing, e, arena)) {
+                string_t const sub =
+                    path_join(dir, e->name, cstr_len(e->name), true, arena);
+                glob_match_from(cache, pat, comp_idx + 1, sub, out, arena);
+            }
+        }
+    }
+}
+
+// Pushes the sorted matches of the pattern, false if there are none.
+// A trailing ** lists everything below like **/* does.
+static b32 glob_expand(string_t pattern, word_list_t *out, arena_t *arena)
+{
+    if (!dir_cache_ensure(&g_dir_cache))
+        return false;
+
+    glob_pattern_t pat = {0};
+    u32 max_comps = 2;
+    for (u64 i = 0; i < pattern.len; ++i)
+        max_comps += pattern.p[i] == '/';
+    pat.comps = ARENA_ALLOC_N(arena, string_t, max_comps);
+
+    string_t dir = {"", 0};
+    u64 start = 0;
+    if (pattern.len > 0 && pattern.p[0] == '/') {
+        dir = path_join(dir, "/", 1, false, arena);
+        start = 1;
+    }
+    for (u64 i = start; i <= pattern.len; ++i) {
+        if (i == pattern.len || pattern.p[i] == '/') {
+            string_t const comp = {pattern.p + start, i - start};
+            pat.comps[pat.comp_cnt++] = comp;
+            start = i + 1;
+        }
+    }
+    string_t const *last = &pat.comps[pat.comp_cnt - 1];
+    if (last->len == 2 && last->p[0] == '*' && last->p[1] == '*') {
+        string_t const any = {"*", 1};
+        pat.comps[pat.comp_cnt++] = any;
+    }
+
+    word_list_t matches = {0};
+    glob_match_from(&g_dir_cache, &pat, 0, dir, &matches, arena);
+    if (matches.cnt == 0)
+        return false;
+    sort_word_list(&matches, arena);
+    word_list_append(out, &matches);
+    return true;
+}
+
+// The word being built is pending while its text.p is set. It is grown in
+// place as long as it sits at the top of the arena. Where globs are
+// allowed, quoted glob chars and every \ are screened with a \ so that the
+// pattern matcher sees them as literals.
+typedef struct word_builder {
+    string_t text;
+    b32 glob_ok;
+    b32 globs;   // an unquoted glob char went in
+    b32 escaped; // a \ was added
+} word_builder_t;
+
+static void wb_append(
+    word_builder_t *wb, char const *p, u64 len, b32 quoted, arena_t *arena)
+{
+    u64 extra = 0;
+    for (u64 i = 0; wb->glob_ok && i < len; ++i) {
+        if (p[i] == '\\' || (quoted && is_glob_char(p[i])))
+            ++extra;
+        else if (is_glob_char(p[i]))
+            wb->globs = true;
+    }
+
+    string_t *word = &wb->text;
+    char const *top = arena->buf.p + arena->allocated;
+    if (word->p && word->p + word->len + 1 == top)
+        (void)ARENA_ALLOC_N(arena, char, len + extra);
+    else {
+        char *copy = ARENA_ALLOC_N(arena, char, word->len + len + extra + 1);
+        if (word->len)
+            mem_cpy(copy, word->p, word->len);
+        word->p = copy;
+    }
+
+    if (!extra) {
+        mem_cpy(word->p + word->len, p, len);
+        word->len += len;
+    } else {
+        for (u64 i = 0; i < len; ++i) {
+            if (p[i] == '\\' || (quoted && is_glob_char(p[i])))
+                word->p[word->len++] = '\\';
+            word->p[word->len++] = p[i];
+        }
+        wb->escaped = true;
+    }
+    word->p[word->len] = '\0';
+}
+
+static void wb_finish(word_builder_t *wb, word_list_t *out, arena_t *arena)
+{
+    if (wb->text.p) {
+        b32 const matched = wb->globs && has_glob(wb->text) &&
+            glob_expand(wb->text, out, arena);
+        if (!matched) {
+            if (wb->escaped)
+                unescape_in_place(&wb->text);
+            word_list_push(out, wb->text, arena);
+        }
+    }
+    clear_string(&wb->text);
+    wb->globs = false;
+    wb->escaped = false;
+}
+
+static inline b32 is_field_separator(char c)
+{
+    return (c == ' ') | (c == '\t') | (c == '\n');
+}
+
+// Unquoted output is split into words in place: the separator after a word
+// becomes its NUL. Only the words glued to the text around, and the ones
+// that need screening for globs, are copied.
+static void split_fields(
+    string_t text, word_builder_t *wb, word_list_t *out, arena_t *arena)
+{
+    u64 i = 0;
+    while (i < text.len) {
+        if (is_field_separator(text.p[i])) {
+            wb_finish(wb, out, arena);
+            while (i < text.len && is_field_separator(text.p[i]))
+                ++i;
+            continue;
+        }
+
+        b32 plain = true;
+        u64 end = i;
+        for (; end < text.len && !is_field_separator(text.p[end]); ++end)
+            plain &= !wb->glob_ok ||
+                (text.p[end] != '\\' && !is_glob_char(text.p[end]));
+        string_t field = {text.p + i, end - i};
+        if (plain && end == text.len && !wb->text.p)
+            wb->text = field; // text is NUL-terminated
+        else if (plain && !wb->text.p) {
+            text.p[end++] = '\0';
+            word_list_push(out, field, arena);
+        } else {
+            wb_append(wb, field.p, field.len, false, arena);
+            if (end < text.len)
+                wb_finish(wb, out, arena);
+        }
+        i = end;
+    }
+}
+
+// Index just past a $NAME or ${NAME} at pos, 0 if it is not a valid one
+static u64 parse_var_ref(string_t s, u64 pos, string_t *out_name)
+{
+    ASSERT(is_var_ref_start(s, pos));
+    b32 const braced = s.p[pos + 1] == '{';
+    u64 const start = pos + 1 + braced;
+    u64 end = start;
+    while (end < s.len && is_var_name_char(s.p[end]))
+        ++end;
+
+    out_name->p = s.p + start;
+    out_name->len = end - start;
+    if (!braced)
+        return end;
+    else if (end == start || end == s.len || s.p[end] != '}')
         return 0;
-    else if (pp->is_cd) {
-        command_node_t const *cmd = pp->chain->runnable.cmd;
-        char const *dir = NULL;
+    return end + 1;
+}
 
-        string_t const homedirstr = LITSTR("~");
+// Expands the source text of a word, which can make any number of words.
+// Without split it makes exactly one, like the value of an assignment.
+static b32 expand_word(
+    string_t src, b32 split, word_list_t *out, arena_t *arena)
+{
+    word_builder_t wb = {0};
+    wb.glob_ok = split;
+    b32 in_quotes = false;
+    u64 i = 0;
+    while (i < src.len) {
+        char const c = src.p[i];
+        string_t text = {0};
+        if (c == '\\' && i + 1 < src.len) {
+            wb_append(&wb, src.p + i + 1, 1, true, arena);
+            i += 2;
+            continue;
+        } else if (c == '"') {
+            in_quotes = !in_quotes;
+            wb_append(&wb, "", 0, true, arena); // "" is still a word
+            ++i;
+            continue;
+        } else if (is_cmd_subst_start(src, i)) {
+            u64 const end = skip_cmd_subst(src, i);
+            ASSERT(end); // checked by the lexer
+            u64 const open_len = c == '`' ? 1 : 2;
+            string_t inner = {src.p + i + open_len, end - i - open_len - 1};
+            text = capture_output(inner, arena);
+            if (!string_is_valid(&text))
+                return false;
+            i = end;
+        } else if (is_var_ref_start(src, i)) {
+            string_t name;
+            u64 const end = parse_var_ref(src, i, &name);
+            if (!end) {
+                fprintf(stderr, "%.*s: bad substitution\n",
+                    STR_PRINTF_ARGS(src));
+                return false;
+            }
+            string_t const value = var_get(&g_vars, name);
+            i = end;
+            if (value.len == 0)
+                continue;
 
-        if (cmd->arg_cnt == 0 || str_eq(cmd->args->name, homedirstr)) {
-            if ((dir = getenv("HOME")) == NULL)
-                dir = getpwuid(getuid())->pw_dir;
-        } else
-            dir = cmd->args->name.p;
+            // Splitting writes into the text
+            text.p = ARENA_ALLOC_N(arena, char, value.len + 1);
+            text.len = value.len;
+            mem_cpy(text.p, value.p, value.len + 1);
+        } else {
+            u64 end = i + 1;
+            while (end < src.len && src.p[end] != '\\' && src.p[end] != '"' &&
+                   !is_cmd_subst_start(src, end) &&
+                   !is_var_ref_start(src, end))
+            {
+                ++end;
+            }
+            wb_append(&wb, src.p + i, end - i, in_quotes, arena);
+            i = end;
+            continue;
+        }
 
-        return chdir(dir) == 0 ? 0 : 1;
+        if (in_quotes || !split)
+            wb_append(&wb, text.p, text.len, in_quotes, arena);
+        else
+            split_fields(text, &wb, out, arena);
     }
 
-    signal(SIGCHLD, SIG_DFL);
+    if (!split && !wb.text.p)
+        wb_append(&wb, "", 0, true, arena);
+    wb_finish(&wb, out, arena);
+    return true;
+}
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        detach_group();
-        if (is_term)
-            set_pgroup_as_term_fg();
+static b32 expand_into(
+    string_t word, b32 expand, b32 split, word_list_t *out, arena_t *arena)
+{
+    if (!expand) {
+        word_list_push(out, word, arena);
+        return true;
+    }
+    return expand_word(word, split, out, arena);
+}
 
-        _exit(execute_pipe_in_subprocess(pp, arena));
-    } else if (pid == -1) {
-        sigchld_handler(0);
-        return -1;
+// *out is NULL if nothing is left of the command
+static b32 expand_command(
+    command_node_t const *cmd, command_node_t **out, arena_t *arena)
+{
+    word_list_t assigns = {0};
+    for (arg_node_t const *a = cmd->assigns; a; a = a->next) {
+        if (!expand_into(a->name, a->expand, false, &assigns, arena))
+            return false;
+    }
+
+    word_list_t words = {0};
+    if (string_is_valid(&cmd->cmd) &&
+        !expand_into(cmd->cmd, cmd->cmd_expand, true, &words, arena))
+    {
+        return false;
+    }
+    for (arg_node_t const *arg = cmd->args; arg; arg = arg->next) {
+        if (!expand_into(arg->name, arg->expand, true, &words, arena))
+            return false;
     }
 
-    int res = await_processes(&pid, 1);
+    *out = NULL;
+    if (words.cnt == 0 && assigns.cnt == 0)
+        return true;
 
-    if (is_term)
-        set_pgroup_as_term_fg();
+    command_node_t *res = ARENA_ALLOC(arena, command_node_t);
+    CLEAR(res);
+    res->assigns = assigns.first;
+    res->assign_cnt = assigns.cnt;
+    if (words.cnt > 0) {
+        res->cmd = words.first->name;
+        res->args = words.first->next;
+        res->arg_cnt = words.cnt - 1;
+        res->builtin = find_builtin(res);
+    }
+    *out = res;
+    return true;
+}
+
+static b32 expand_redir(string_t *target, arena_t *arena)
+{
+    word_list_t words = {0};
+    if (!expand_word(*target, true, &words, arena))
+        return false;
+    if (words.cnt != 1) {
+        fprintf(stderr, "%.*s: ambiguous redirect\n", STR_PRINTF_ARGS(*target));
+        return false;
+    }
+    *target = words.first->name;
+    return true;
+}
+
+static inline b32 is_heredoc_special(char c)
+{
+    return (c == '$') | (c == '`') | (c == '\\');
+}
+
+// A heredoc body only has $NAME, ${NAME}, $(...) and `...`, a backslash
+// screens them. Quotes are plain text in it, and nothing is split.
+static b32 expand_heredoc_body(string_t src, string_t *out, arena_t *arena)
+{
+    word_builder_t wb = {0};
+    wb_append(&wb, "", 0, false, arena);
+    u64 i = 0;
+    while (i < src.len) {
+        u64 subst_end;
+        if (src.p[i] == '\\' && i + 1 < src.len &&
+            is_heredoc_special(src.p[i + 1]))
+        {
+            wb_append(&wb, src.p + i + 1, 1, false, arena);
+            i += 2;
+        } else if (is_cmd_subst_start(src, i) &&
+                   (subst_end = skip_cmd_subst(src, i)))
+        {
+            u64 const open_len = src.p[i] == '`' ? 1 : 2;
+            string_t inner = {
+                src.p + i + open_len, subst_end - i - open_len - 1};
+            string_t const text = capture_output(inner, arena);
+            if (!string_is_valid(&text))
+                return false;
+            wb_append(&wb, text.p, text.len, false, arena);
+            i = subst_end;
+        } else if (is_var_ref_start(src, i)) {
+            string_t name;
+            u64 const end = parse_var_ref(src, i, &name);
+            if (!end) {
+                fprintf(stderr, "heredoc: bad substitution\n");
+                return false;
+            }
+            string_t const value = var_get(&g_vars, name);
+            if (value.len > 0)
+                wb_append(&wb, value.p, value.len, false, arena);
+            i = end;
+        } else {
+            u64 end = i + 1;
+            while (end < src.len && !is_heredoc_special(src.p[end]))
+                ++end;
+            wb_append(&wb, src.p + i, end - i, false, arena);
+            i = end;
+        }
+    }
+    *out = wb.text;
+    return true;
+}
+
+static b32 expand_stdin_doc(
+    stdin_doc_t const *doc, stdin_doc_t **out, arena_t *arena)
+{
+    stdin_doc_t *res = ARENA_ALLOC(arena, stdin_doc_t);
+    *res = *doc;
+    res->expand = false;
+    if (doc->is_word) {
+        word_list_t words = {0};
+        if (!expand_word(doc->text, false, &words, arena))
+            return false;
+        res->text = words.first->name;
+    } else if (!expand_heredoc_body(doc->text, &res->text, arena))
+        return false;
+    *out = res;
+    return true;
+}
+
+static b32 command_has_expansions(command_node_t const *cmd)
+{
+    if (cmd->cmd_expand)
+        return true;
+    for (arg_node_t const *arg = cmd->args; arg; arg = arg->next) {
+        if (arg->expand)
+            return true;
+    }
+    for (arg_node_t const *a = cmd->assigns; a; a = a->next) {
+        if (a->expand)
+            return true;
+    }
+    return false;
+}
+
+// Expansions happen right before the pipe runs so that they see the effects
+// of the commands before it on the line. NULL if some expansion failed.
+static pipe_chain_node_t const *expand_pipe_chain(
+    pipe_chain_node_t const *pp, arena_t *arena)
+{
+    if (!pp->has_expansions)
+        return pp;
+
+    // The pipes before may have changed the dirs, or the cwd
+    dir_cache_reset(&g_dir_cache);
+
+    pipe_chain_node_t *res = ARENA_ALLOC(arena, pipe_chain_node_t);
+    *res = *pp;
+    res->has_expansions = false;
+
+    pipe_node_t **link = &res->chain;
+    for (pipe_node_t const *elem = pp->chain; elem; elem = elem->next) {
+        pipe_node_t *copy = ARENA_ALLOC(arena, pipe_node_t);
+        *copy = *elem;
+        runnable_node_t *r = &copy->runnable;
+        if (!RUNNABLE_IS_EMPTY(r) && r->type == e_rnt_cmd &&
+            command_has_expansions(r->cmd) &&
+            !expand_command(elem->runnable.cmd, &r->cmd, arena))
+        {
+            return NULL;
+        }
+        *link = copy;
+        link = &copy->next;
+    }
+
+    if (pp->stdin_expand && !expand_redir(&res->stdin_redir, arena))
+        return NULL;
+    if (pp->stdin_doc && pp->stdin_doc->expand &&
+        !expand_stdin_doc(pp->stdin_doc, &res->stdin_doc, arena))
+    {
+        return NULL;
+    }
+    if (pp->stdout_expand) {
+        string_t *target = string_is_valid(&res->stdout_redir) ?
+            &res->stdout_redir : &res->stdout_append_redir;
+        if (!expand_redir(target, arena))
+            return NULL;
+    }
     return res;
 }
 
-static int execute_cond_chain(
-    cond_chain_node_t const *chain, b32 is_term, arena_t *arena)
+static int execute_pipe_chain(
+    pipe_chain_node_t const *pp, b32 is_term, b32 exec_in_place,
+    arena_t *arena)
+{
+    if (CHAIN_IS_EMPTY(pp))
+        return 0;
+
+    trace_begin_pipe(pp);
+
+    if (!(pp = expand_pipe_chain(pp, arena))) {
+        trace_end(e_tk_pipe, -2);
+        return -2;
+    }
+
+    // Expansions that came out empty, like $(true), or just assignments.
+    // Shell variables are only set outside of a pipe.
+    runnable_node_t const *first = &pp->chain->runnable;
+    if (pp->cmd_cnt == 1 && (RUNNABLE_IS_EMPTY(first) ||
+        (first->type == e_rnt_cmd && !string_is_valid(&first->cmd->cmd))))
+    {
+        int const res =
+            RUNNABLE_IS_EMPTY(first) ? 0 : assign_vars(first->cmd);
+        trace_end(e_tk_pipe, res);
+        if (exec_in_place) {
+            trace_end_open(res);
+            _exit(res);
+        }
+        return res;
+    }
+
+    // A lone builtin needs no process at all, unless it may block on the
+    // terminal, where only a process of its own can be stopped
+    if (pp->cmd_cnt == 1 && first->type == e_rnt_cmd &&
+        first->cmd->builtin)
+    {
+        fd_pair_t io = {STDIN_FILENO, STDOUT_FILENO};
+        b32 const opened = open_pipe_redirs(pp, io);
+        if (!opened || !first->cmd->builtin->tty_forks ||
+            (!isatty(io[0]) && !isatty(io[1])))
+        {
+            int const res = opened ? run_builtin(first->cmd, io, arena) : -2;
+            close_fd_pair(io);
+            trace_end(e_tk_pipe, res);
+            if (exec_in_place) {
+                trace_end_open(res);
+                _exit(res);
+            }
+            return res;
+        }
+        close_fd_pair(io);
+    }
+
+    char const **exec_paths = resolve_exec_paths(pp, arena);
+
+    if (exec_in_place && pp->cmd_cnt == 1)
+        execute_pipe_in_place(pp, exec_paths[0], arena);
+
+    int const res =
+        execute_pipe_processes(pp, exec_paths, is_term, false, arena);
+    trace_end(e_tk_pipe, res);
+    return res;
+}
+
+// exec_in_place: the process exits after the chain, so the last command
+// executed can replace it instead of being forked
+static int run_cond_chain(
+    cond_chain_node_t const *chain, b32 is_term, b32 exec_in_place,
+    arena_t *arena)
 {
     if (CHAIN_IS_EMPTY(chain))
         return 0;
 
+    trace_begin_cond(chain);
+
     int res = 0;
     for (cond_node_t *cond = chain->chain; cond; cond = cond->next) {
-        res = execute_pipe_chain(&cond->pp, is_term, arena);
+        res = execute_pipe_chain(
+            &cond->pp, is_term, exec_in_place && !cond->next, arena);
 
         if (res == 0 && cond->link == e_cl_if_failed)
-            return res;
+            break;
         else if (res != 0 && cond->link == e_cl_if_success)
-            return res;
+            break;
     }
 
+    trace_end(e_tk_cond, res);
+    return res;
+}
+
+// Measured chains report their cost when done, so nothing replaces the process
+static int execute_cond_chain(
+    cond_chain_node_t const *chain, b32 is_term, b32 exec_in_place,
+    arena_t *arena)
+{
+    u64 const threshold_ms = g_slow_threshold_ms; // it may change meanwhile
+    if (!chain->timed && threshold_ms == 0)
+        return run_cond_chain(chain, is_term, exec_in_place, arena);
+
+    run_cost_t cost;
+    run_cost_begin(&cost);
+    int const res = run_cond_chain(chain, is_term, false, arena);
+    run_cost_report_t rep;
+    run_cost_end(&cost, &rep);
+
+    if (chain->timed)
+        print_run_cost(&rep);
+    else if (rep.real * 1000.0 >= (double)threshold_ms) {
+        cmd_desc_t desc = {0};
+        describe_cond_chain(&desc, chain);
+        print_slow_run_cost(&rep, &desc);
+    }
     return res;
 }
 
+// A lone pipe is launched straight from the shell so that its stages are
+// tracked one by one, anything longer runs in a forked copy of the shell
+static int execute_in_background(
+    cond_chain_node_t const *chain, b32 is_term, arena_t *arena)
+{
+    if (CHAIN_IS_EMPTY(chain))
+        return 0;
+
+    if (chain->cond_cnt == 1 && !chain->timed) {
+        pipe_chain_node_t const *pp = &chain->chain->pp;
+        if (CHAIN_IS_EMPTY(pp))
+            return 0;
+        if (!(pp = expand_pipe_chain(pp, arena)))
+            return -2;
+        if (pp->cmd_cnt == 1 && RUNNABLE_IS_EMPTY(&pp->chain->runnable))
+            return 0;
+        return execute_pipe_processes(
+            pp, resolve_exec_paths(pp, arena), is_term, true, arena);
+    }
+
+    pid_t pid = fork();
+    if (pid == -1)
+        return -2;
+    if (pid == 0) {
+        detach_group();
+        reset_forked_shell();
+
+        _exit(execute_cond_chain(chain, false, true, arena));
+    }
+
+    setpgid(pid, pid);
+    trace_instant(e_tk_fork, "fork", pid, 0);
+    job_t *job = job_table_add(&g_jobs, pid, &pid, 1);
+    if (!job)
+        return -2;
+    describe_cond_chain(&job->desc, chain);
+    g_jobs.current = job->id;
+    announce_bg_job(job);
+    return 0;
+}
+
 static int execute_uncond_chain(
-    uncond_chain_node_t const *chain, b32 is_term, arena_t *arena)
+    uncond_chain_node_t const *chain, b32 is_term, b32 exec_in_place,
+    arena_t *arena)
 {
     if (CHAIN_IS_EMPTY(chain))
         return 0;
 
+    trace_begin_uncond(chain);
+
     int res = 0;
     for (uncond_node_t *uncond = chain->chain; uncond; uncond = uncond->next) {
         if (uncond->link == e_ul_bg) {
-            pid_t pid = fork();
-            if (pid == -1)
-                return -2;
-            if (pid == 0) {
-                detach_group();
-
-                _exit(execute_cond_chain(&uncond->cond, false, arena));
-            }
-        } else
-            res = execute_cond_chain(&uncond->cond, is_term, arena);
+            res = execute_in_background(&uncond->cond, is_term, arena);
+        } else {
+            res = execute_cond_chain(
+                &uncond->cond, is_term, exec_in_place && !uncond->next, arena);
+        }
     }
+
+    trace_end(e_tk_uncond, res);
     return res;
 }
 
 static int execute_line(root_node_t const *ast, b32 is_term, arena_t *arena)
 {
-    return execute_uncond_chain(ast, is_term, arena);
+    return execute_uncond_chain(ast, is_term, false, arena);
+}
+
+// Bodies follow the line in the order of their heredocs, each up to a line
+// that is just its delimiter. The input ending first also ends the body.
+static void read_heredoc_bodies(
+    stdin_doc_t *docs, block_reader_t *rd, terminal_session_t *term,
+    arena_t *arena)
+{
+    b32 eof = false;
+    for (stdin_doc_t *doc = docs; doc; doc = doc->next_pending) {
+        word_builder_t body = {0};
+        b32 specials = false;
+        wb_append(&body, "", 0, false, arena);
+
+        while (!eof) {
+            string_t line = {0};
+            int const rl = term ?
+                read_line_from_terminal(arena, &line, term) :
+                read_line_from_block_reader(rd, arena, &line);
+            if (rl == c_rl_eof) {
+                fprintf(stderr, "heredoc: wanted '%.*s', got end of input\n",
+                    STR_PRINTF_ARGS(doc->delim));
+                eof = true;
+            } else if (str_eq(line, doc->delim))
+                break;
+            else {
+                for (u64 i = 0; i < line.len && !specials; ++i)
+                    specials = is_heredoc_special(line.p[i]);
+                wb_append(&body, line.p, line.len, false, arena);
+                wb_append(&body, "\n", 1, false, arena);
+            }
+        }
+
+        doc->text = body.text;
+        doc->expand &= specials;
+    }
 }
 
 int main(int argc, char **argv)
@@ -1628,10 +6971,16 @@ int main(int argc, char **argv)
     b32 execute = true;
     b32 print_ast = false;
     b32 disable_term = false;
+    b32 mem_stats = false;
+    char const *script_path = NULL;
+    char const *trace_path = NULL;
 
     string_t const only_parse_arg = LITSTR("--parser-only");
     string_t const print_ast_arg = LITSTR("--print-ast");
     string_t const disable_term_arg = LITSTR("--no-term-input");
+    string_t const mem_stats_arg = LITSTR("--mem-stats");
+    string_t const trace_arg = LITSTR("--trace");
+    string_t const flag_prefix = LITSTR("-");
 
     for (int i = 1; i < argc; ++i) {
         string_t arg = str_from_cstr(argv[i]);
@@ -1643,6 +6992,12 @@ int main(int argc, char **argv)
             print_ast = true;
         } else if (str_eq(arg, disable_term_arg)) {
             disable_term = true;
+        } else if (str_eq(arg, mem_stats_arg)) {
+            mem_stats = true;
+        } else if (str_eq(arg, trace_arg) && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (!script_path && !str_is_prefix_of(flag_prefix, arg)) {
+            script_path = argv[i];
         } else {
             fprintf(stderr, "Invalid arg: %s\n", argv[i]);
             return 1;
@@ -1651,22 +7006,23 @@ int main(int argc, char **argv)
 
     int res = 0;
 
-    buffer_t memory = allocate_buffer(c_program_mem_size);
-    arena_t persistent_arena = {{
-        memory.p,
-        c_persistent_mem_size
-    }, 0};
-    arena_t line_arena = {{
-        memory.p + c_persistent_mem_size,
-        c_line_mem_size
-    }, 0};
-    arena_t temp_arena = {{
-        memory.p + c_persistent_mem_size + c_line_mem_size,
-        c_temp_mem_size
-    }, 0};
+    if (trace_path && !trace_init(&g_trace, trace_path)) {
+        perror("trace");
+        return 1;
+    }
+
+    arena_t persistent_arena, line_arena, temp_arena;
+    if (!arena_init(&persistent_arena, "persistent", c_persistent_mem_size) ||
+        !arena_init(&line_arena, "line", c_line_mem_size) ||
+        !arena_init(&temp_arena, "temp", c_temp_mem_size))
+    {
+        fprintf(stderr, "Failed to reserve memory for the arenas\n");
+        return 1;
+    }
 
     b32 const is_term =
-        isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) && !disable_term;
+        isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) &&
+        !disable_term && !script_path;
     terminal_session_t term = {0};
 
     if (is_term) {
@@ -1675,30 +7031,66 @@ int main(int argc, char **argv)
         init_term(&term);
     }
 
-    signal(SIGCHLD, sigchld_handler);
+    block_reader_t input_reader = {0};
+    if (script_path) {
+        if (!init_mapped_block_reader(
+                &input_reader, script_path, &persistent_arena))
+        {
+            perror(script_path);
+            return 1;
+        }
+    } else if (!is_term)
+        init_block_reader(&input_reader, STDIN_FILENO, &persistent_arena);
+
+    if (!init_var_store(&g_vars, &persistent_arena)) {
+        fprintf(stderr, "Failed to reserve memory for the environment\n");
+        return 1;
+    }
+    init_cmd_hash(&g_cmd_hash);
+    init_plan_cache(&g_plans);
+
+    // ^C only interrupts wait, it is read from the loop
+    if (!init_event_loop(&g_loop, is_term ? STDIN_FILENO : -1, is_term)) {
+        perror("event loop");
+        return 1;
+    }
+
+    // In-process builtins get EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    g_job_control = is_term;
+    if (is_term) {
+        // The shell itself is never stopped
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+
+        g_jobs.shell_tmodes = term.backup_ts;
+        g_jobs.has_shell_tmodes = true;
+    }
 
     int read_res;
 
     for (;;) {
-        buffer_t line_storage = {
-            ARENA_ALLOC_N(&line_arena, char, c_line_buf_size),
-            c_line_buf_size
-        };
         string_t line = {0};
 
+        if (is_term) {
+            notify_finished_jobs();
+            term_sync_path(&term);
+        } else {
+            jobs_reap();
+            drop_old_finished_jobs();
+        }
+
         if (is_term)
-            read_res = read_line_from_terminal(&line_storage, &line, &term);
-        else
-            read_res = read_line_from_regular_stdin(&line_storage, &line);
-
-        if (read_res == c_rl_string_overflow) {
-            fprintf(
-                stderr,
-                "The line is over the limit of %d charactes "
-                "and will not be processed\n",
-                c_line_buf_size);
-            goto loop_end;
-        } else if (read_res == c_rl_eof)
+            read_res = read_line_from_terminal(&line_arena, &line, &term);
+        else {
+            read_res =
+                read_line_from_block_reader(&input_reader, &line_arena, &line);
+        }
+
+        if (read_res == c_rl_eof)
             break;
         else if (line.len == 0)
             goto loop_end;
@@ -1706,9 +7098,35 @@ int main(int argc, char **argv)
         if (is_term)
             history_push(&term, line);
 
-        root_node_t *ast_root = parse_line(line, &line_arena);
-        if (!ast_root)
-            goto loop_end;
+        u64 const line_hash = str_hash(line);
+        root_node_t const *ast_root =
+            plan_cache_get(&g_plans, line, line_hash);
+        if (!ast_root) {
+            // Reading heredoc bodies moves the block the line is a view of
+            if (!is_term && input_reader.mapped_sz == 0 &&
+                memmem(line.p, line.len, "<<", 2))
+            {
+                char *copy = ARENA_ALLOC_N(&line_arena, char, line.len);
+                mem_cpy(copy, line.p, line.len);
+                line.p = copy;
+            }
+
+            trace_begin(e_tk_parse, line.p, line.len);
+            stdin_doc_t *heredocs = NULL;
+            root_node_t *parsed = parse_line(line, &heredocs, &line_arena);
+            trace_end(e_tk_parse, parsed ? 0 : 1);
+            if (!parsed)
+                goto loop_end;
+
+            if (heredocs) {
+                read_heredoc_bodies(
+                    heredocs, is_term ? NULL : &input_reader,
+                    is_term ? &term : NULL, &line_arena);
+                ast_root = compile_plan(parsed, &line_arena);
+            } else
+                ast_root = plan_cache_add(
+                    &g_plans, line, line_hash, parsed, &line_arena);
+        }
 
         if (print_ast)
             print_uncond_chain(ast_root, 0);
@@ -1723,13 +7141,29 @@ int main(int argc, char **argv)
 
     loop_end:
         arena_drop(&line_arena);
+        dir_cache_reset(&g_dir_cache);
     }
 
+    job_table_shutdown(&g_jobs);
+
     pid_t awaited;
     while ((awaited = waitpid(-1, NULL, 0)) > 0)
         ;
 
-    free_buffer(&memory);
+    if (mem_stats)
+        print_arena_stats(STDERR_FILENO);
+    trace_finish(&g_trace);
+
+    release_block_reader(&input_reader);
+    release_cmd_hash(&g_cmd_hash);
+    release_var_store(&g_vars);
+    release_dir_cache(&g_dir_cache);
+    release_plan_cache(&g_plans);
+    release_event_loop(&g_loop);
+
+    arena_release(&temp_arena);
+    arena_release(&line_arena);
+    arena_release(&persistent_arena);
 
     if (is_term)
         shutdown_term(&term, read_res != c_rl_eof);
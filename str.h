@@ -45,6 +45,16 @@ static inline bool str_eq(string_t s1, string_t s2)
     return true;
 }
 
+static inline int str_cmp(string_t s1, string_t s2)
+{
+    u64 const min_len = s1.len < s2.len ? s1.len : s2.len;
+    for (char *p1 = s1.p, *p2 = s2.p; p1 != s1.p + min_len; ++p1, ++p2) {
+        if (*p1 != *p2)
+            return (u8)*p1 < (u8)*p2 ? -1 : 1;
+    }
+    return s1.len == s2.len ? 0 : (s1.len < s2.len ? -1 : 1);
+}
+
 static inline bool str_is_prefix_of(string_t prefix, string_t of)
 {
     if (prefix.len > of.len)
@@ -65,6 +75,17 @@ static inline bool str_has_chr(string_t s, char c)
     return false;
 }
 
+// FNV-1a
+static inline u64 str_hash(string_t s)
+{
+    u64 h = 14695981039346656037ull;
+    for (char *p = s.p; p != s.p + s.len; ++p) {
+        h ^= (u8)*p;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
 static inline string_t str_from_cstr(char *cstr)
 {
     string_t res = {cstr, 0};